@@ -0,0 +1,553 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "block_meta.h"
+#include "heap.h"
+#include "mmap_cache.h"
+#include "options.h"
+#include "pool.h"
+#include "stats.h"
+
+// at most one arena per CPU is used, up to ARENA_MAX
+#define ARENA_MAX 64
+
+// arenas other than the main one grow inside REGION_SIZE-aligned regions
+// instead of the program break, so that the arena of a block can be found
+// from its address
+#define REGION_SIZE (64UL << 20)
+
+struct region {
+	struct arena *arena;
+};
+
+// objects on a remote free stack are linked through their first word
+struct remote_free {
+	struct remote_free *next;
+};
+
+// the main arena grows with sbrk(), or inside regions in huge page mode
+static struct arena main_arena = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct arena *arenas[ARENA_MAX] = { &main_arena };
+static unsigned int nr_arenas;
+static unsigned int next_arena;
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct arena *thread_arena __attribute__((tls_model("initial-exec")));
+
+// the key destructor lets the arena of a thread go when the thread exits
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+// 1 while the background purge thread runs
+static int background_running;
+
+void *map_aligned(size_t len, size_t align, int flags)
+{
+	char *map = mmap(NULL, len + align, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	uintptr_t start;
+	int error;
+
+	DIE(map == MAP_FAILED, "mmap failed");
+	stat_add(&stats.mmap_calls, 1);
+
+	// keep the aligned part of the mapping
+	start = ((uintptr_t)map + align - 1) & ~(align - 1);
+	if (start != (uintptr_t)map) {
+		error = munmap(map, start - (uintptr_t)map);
+		DIE(error == -1, "munmap failed!");
+		stat_add(&stats.munmap_calls, 1);
+	}
+	error = munmap((char *)start + len, (uintptr_t)map + align - start);
+	DIE(error == -1, "munmap failed!");
+	stat_add(&stats.munmap_calls, 1);
+
+	return (void *)start;
+}
+
+// maps a region aligned to its size, its pages are only used on demand
+static struct region *map_region(struct arena *arena)
+{
+	struct region *region = map_aligned(REGION_SIZE, REGION_SIZE, MAP_NORESERVE);
+
+	// regions are aligned to huge pages, which only have to be asked for
+	if (__atomic_load_n(&options.thp, __ATOMIC_RELAXED))
+		madvise(region, REGION_SIZE, MADV_HUGEPAGE);
+
+	region->arena = arena;
+
+	return region;
+}
+
+// the main arena grows with sbrk() unless it started in huge page mode
+static int uses_sbrk(struct arena *arena)
+{
+	return arena == &main_arena && !arena->end;
+}
+
+// the heap of the arena continues in the region, after its header
+static void set_region(struct arena *arena, struct region *region, void *header_end)
+{
+	arena->brk = (char *)(((uintptr_t)header_end + 63) & ~63UL);
+	arena->end = (char *)region + REGION_SIZE;
+}
+
+// the arena itself sits at the start of its first region
+static struct arena *create_arena(void)
+{
+	struct region *region = map_region(NULL);
+	struct arena *arena = (struct arena *)(region + 1);
+
+	region->arena = arena;
+	pthread_mutex_init(&arena->lock, NULL);
+	arena->block_flags = BLOCK_NON_MAIN;
+	set_region(arena, region, arena + 1);
+
+	return arena;
+}
+
+// the thread stops using the arena, with the arenas lock held
+static void arena_leave(struct arena *arena)
+{
+	if (arena && !--arena->users)
+		arena->abandoned = 1;
+}
+
+// leaves the old arena of the thread and picks an abandoned arena, or the
+// next one in round-robin order, creating it on first use
+static struct arena *next_round_robin(struct arena *old)
+{
+	struct arena *arena = NULL;
+	unsigned int i;
+	long cpus;
+
+	pthread_mutex_lock(&arenas_lock);
+	if (!nr_arenas) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_arenas = cpus < 1 ? 1 : cpus > ARENA_MAX ? ARENA_MAX : cpus;
+	}
+
+	arena_leave(old);
+	for (i = 0; i < nr_arenas; i++) {
+		if (arenas[i] && arenas[i] != old && arenas[i]->abandoned) {
+			arena = arenas[i];
+			break;
+		}
+	}
+
+	if (!arena) {
+		i = next_arena++ % nr_arenas;
+		if (!arenas[i])
+			arenas[i] = create_arena();
+		arena = arenas[i];
+	}
+
+	arena->abandoned = 0;
+	arena->users++;
+	pthread_mutex_unlock(&arenas_lock);
+
+	return arena;
+}
+
+// frees the objects from first to last, the arena must be locked
+static void free_list(struct arena *arena, struct remote_free *first, struct remote_free *last)
+{
+	struct remote_free *next;
+
+	for (;;) {
+		next = first->next;
+		heap_free(arena, first);
+		if (first == last)
+			break;
+		first = next;
+	}
+}
+
+// takes the whole remote free stack at once and frees it
+static void drain_remote(struct arena *arena)
+{
+	struct remote_free *first, *last;
+
+	if (!__atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED))
+		return;
+
+	first = __atomic_exchange_n(&arena->remote_free, NULL, __ATOMIC_ACQUIRE);
+	for (last = first; last->next; last = last->next)
+		;
+
+	free_list(arena, first, last);
+}
+
+// drains the remote free stack of a locked arena and unlocks it, the
+// objects pushed by threads that failed to lock it meanwhile are drained
+// by whoever gets the lock next
+static void drain_unlock(struct arena *arena)
+{
+	for (;;) {
+		drain_remote(arena);
+		arena_unlock(arena);
+
+		// a push that saw the arena locked is seen after the unlock
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED) ||
+		    pthread_mutex_trylock(&arena->lock))
+			return;
+	}
+}
+
+// the thread exits, its arena is drained once more and abandoned if no
+// other thread uses it
+static void arena_thread_exit(void *arg)
+{
+	struct arena *arena = arg;
+
+	thread_arena = NULL;
+	pthread_mutex_lock(&arenas_lock);
+	arena_leave(arena);
+	pthread_mutex_unlock(&arenas_lock);
+
+	arena_lock(arena);
+	drain_unlock(arena);
+}
+
+static void arena_key_create(void)
+{
+	pthread_key_create(&arena_key, arena_thread_exit);
+}
+
+// the background thread wakes up once per decay step and lets the dirty
+// pages of every arena decay, until it is turned off
+static void *background_purge(void *arg)
+{
+	struct timespec ts;
+	long step;
+	unsigned int i;
+
+	(void)arg;
+	while (__atomic_load_n(&options.background_purge, __ATOMIC_RELAXED)) {
+		step = __atomic_load_n(&options.decay_ms, __ATOMIC_RELAXED) / DECAY_STEPS;
+		if (step < 10)
+			step = 10;
+		ts.tv_sec = step / 1000;
+		ts.tv_nsec = step % 1000 * 1000000;
+		nanosleep(&ts, NULL);
+
+		pthread_mutex_lock(&arenas_lock);
+		for (i = 0; i < ARENA_MAX; i++) {
+			if (!arenas[i])
+				continue;
+
+			arena_lock(arenas[i]);
+			heap_decay(arenas[i]);
+			arena_unlock(arenas[i]);
+		}
+		pthread_mutex_unlock(&arenas_lock);
+	}
+
+	__atomic_store_n(&background_running, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// without the background thread, the dirty pages of an arena decay while
+// it is used
+static void decay(struct arena *arena)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int expected = 0;
+
+	if (!__atomic_load_n(&options.background_purge, __ATOMIC_RELAXED)) {
+		heap_decay(arena);
+		return;
+	}
+
+	if (__atomic_load_n(&background_running, __ATOMIC_RELAXED) ||
+	    !__atomic_compare_exchange_n(&background_running, &expected, 1, 0,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, background_purge, NULL)) {
+		__atomic_store_n(&background_running, 0, __ATOMIC_RELAXED);
+		heap_decay(arena);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+struct arena *arena_get(void)
+{
+	struct arena *arena = thread_arena;
+
+	if (!arena || pthread_mutex_trylock(&arena->lock)) {
+		// first use, or another thread holds the arena: move to the next one
+		arena = next_round_robin(arena);
+		thread_arena = arena;
+		pthread_once(&arena_once, arena_key_create);
+		pthread_setspecific(arena_key, arena);
+		arena_lock(arena);
+	}
+
+	drain_remote(arena);
+	decay(arena);
+	return arena;
+}
+
+// pushes the objects from first to last on the remote free stack of a busy
+// arena
+static void remote_push(struct arena *arena, struct remote_free *first,
+			struct remote_free *last)
+{
+	struct remote_free *head = __atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED);
+
+	do {
+		last->next = head;
+	} while (!__atomic_compare_exchange_n(&arena->remote_free, &head, first, 1,
+					      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	// the holder may have drained the stack before the push and be done
+	// with the arena, the objects must not wait for its next user
+	if (!pthread_mutex_trylock(&arena->lock))
+		drain_unlock(arena);
+}
+
+void arena_free(struct arena *arena, void *first, void *last)
+{
+	// the arena of the thread is waited for, another one is only used if
+	// nobody holds it
+	if (arena == thread_arena) {
+		arena_lock(arena);
+	} else if (pthread_mutex_trylock(&arena->lock)) {
+		remote_push(arena, first, last);
+		return;
+	}
+
+	free_list(arena, first, last);
+	decay(arena);
+	drain_unlock(arena);
+}
+
+void arena_free_list(void *list)
+{
+	struct remote_free *entry = list;
+	struct remote_free *first, *next;
+	struct arena *arena;
+
+	while (entry) {
+		arena = arena_of(entry);
+		first = entry;
+		while (entry->next && arena_of(entry->next) == arena)
+			entry = entry->next;
+
+		next = entry->next;
+		arena_free(arena, first, entry);
+		entry = next;
+	}
+}
+
+struct arena *arena_of(void *ptr)
+{
+	struct slab_run *run = slab_lookup(ptr);
+	struct block *block = payload_block(ptr);
+	struct region *region;
+
+	if (run)
+		return slab_arena(run);
+
+	if (!test_flag(block, BLOCK_NON_MAIN))
+		return &main_arena;
+
+	region = (struct region *)((uintptr_t)block & ~(REGION_SIZE - 1));
+	return region->arena;
+}
+
+void *arena_sbrk(struct arena *arena, size_t increment)
+{
+	struct region *region;
+	size_t pad;
+	char *ptr;
+
+	// the break is not aligned to huge pages, so in huge page mode the main
+	// arena starts in a region like the others
+	if (arena == &main_arena && !arena->base && !arena->end &&
+	    __atomic_load_n(&options.thp, __ATOMIC_RELAXED)) {
+		region = map_region(arena);
+		set_region(arena, region, region + 1);
+	}
+
+	// the memory becomes blocks of the heap
+	arena->stats.heap_bytes += increment;
+	stat_footprint(increment);
+
+	// somebody else may have left the program break unaligned
+	if (uses_sbrk(arena)) {
+		pad = -(uintptr_t)sbrk(0) & (ALIGNMENT - 1);
+		ptr = sbrk(increment + pad);
+		stat_add(&stats.sbrk_calls, 1);
+		return ptr == (void *)-1 ? ptr : ptr + pad;
+	}
+
+	// a full region is left behind, its heap ends with a SEG_END block
+	if ((size_t)(arena->end - arena->brk) < increment) {
+		region = map_region(arena);
+		set_region(arena, region, region + 1);
+	}
+
+	ptr = arena->brk;
+	arena->brk += increment;
+
+	return ptr;
+}
+
+int arena_grow(struct arena *arena, void *end, size_t increment)
+{
+	void *request;
+
+	if (uses_sbrk(arena)) {
+		// somebody else moved the program break, the heap cannot grow
+		if (sbrk(0) != end)
+			return -1;
+
+		request = sbrk(increment);
+		DIE(request == (void *)-1, "sbrk failed");
+		stat_add(&stats.sbrk_calls, 1);
+	} else {
+		if (arena->brk != end || (size_t)(arena->end - arena->brk) < increment)
+			return -1;
+
+		arena->brk += increment;
+	}
+
+	arena->stats.heap_bytes += increment;
+	stat_footprint(increment);
+	return 0;
+}
+
+int arena_trim(struct arena *arena, void *end, size_t decrement)
+{
+	void *request;
+
+	if (uses_sbrk(arena)) {
+		// somebody else moved the program break, the heap cannot shrink
+		if (sbrk(0) != end)
+			return -1;
+
+		request = sbrk(-(intptr_t)decrement);
+		DIE(request == (void *)-1, "sbrk failed");
+		stat_add(&stats.sbrk_calls, 1);
+	} else {
+		if (arena->brk != end)
+			return -1;
+
+		// the pages of a region stay mapped, dropping them is what frees them
+		arena->brk -= decrement;
+		madvise(arena->brk, decrement, MADV_DONTNEED);
+	}
+
+	arena->stats.heap_bytes -= decrement;
+	stat_footprint(-(long)decrement);
+	return 0;
+}
+
+void arena_stats(struct arena_stats *sum)
+{
+	struct arena_stats *counters;
+	unsigned int i;
+
+	pthread_mutex_lock(&arenas_lock);
+	for (i = 0; i < ARENA_MAX; i++) {
+		if (!arenas[i])
+			continue;
+
+		arena_lock(arenas[i]);
+		counters = &arenas[i]->stats;
+		sum->heap_bytes += counters->heap_bytes;
+		sum->blocks += counters->blocks;
+		sum->free_bytes += counters->free_bytes;
+		sum->free_blocks += counters->free_blocks;
+		sum->splits += counters->splits;
+		sum->coalesces += counters->coalesces;
+		arena_unlock(arenas[i]);
+	}
+	pthread_mutex_unlock(&arenas_lock);
+}
+
+int os_trim(size_t pad)
+{
+	struct arena *arena;
+	int released = 0;
+	unsigned int i;
+
+	pthread_mutex_lock(&arenas_lock);
+	for (i = 0; i < ARENA_MAX; i++) {
+		arena = arenas[i];
+		if (!arena)
+			continue;
+
+		arena_lock(arena);
+		drain_remote(arena);
+		released |= heap_trim(arena, pad);
+		released |= heap_purge(arena);
+		arena_unlock(arena);
+	}
+	pthread_mutex_unlock(&arenas_lock);
+
+	released |= mmap_cache_trim();
+	return released;
+}
+
+// a child forked while another thread held an arena, the mmap cache or a
+// pool would never get it; pools are locked before the arenas they grow
+// from, and the cache is never locked before an arena
+static void lock_all(void)
+{
+	unsigned int i;
+
+	pool_lock_all();
+	pthread_mutex_lock(&arenas_lock);
+	for (i = 0; i < ARENA_MAX; i++)
+		if (arenas[i])
+			arena_lock(arenas[i]);
+	mmap_cache_lock();
+}
+
+static void unlock_all(void)
+{
+	unsigned int i;
+
+	mmap_cache_unlock();
+	for (i = 0; i < ARENA_MAX; i++)
+		if (arenas[i])
+			arena_unlock(arenas[i]);
+	pthread_mutex_unlock(&arenas_lock);
+	pool_unlock_all();
+}
+
+// the background thread does not survive in the child, it starts again
+// on demand
+static void unlock_all_child(void)
+{
+	unsigned int i;
+
+	// only the forking thread is left, the arenas of the others are abandoned
+	for (i = 0; i < ARENA_MAX; i++) {
+		if (arenas[i]) {
+			arenas[i]->users = arenas[i] == thread_arena;
+			arenas[i]->abandoned = arenas[i] != thread_arena;
+		}
+	}
+
+	background_running = 0;
+	unlock_all();
+}
+
+static void __attribute__((constructor)) arena_atfork_init(void)
+{
+	pthread_atfork(lock_all, unlock_all, unlock_all_child);
+}
@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// memset() and memcpy() over heap buffers, the cost per byte depends on the
+// alignment of the payloads; usage: bench-align [min size] [max size] [rounds]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "osmem.h"
+
+#define BUFFERS 2048
+
+static unsigned char *src[BUFFERS];
+static unsigned char *dst[BUFFERS];
+static size_t sizes[BUFFERS];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+int main(int argc, char **argv)
+{
+	size_t min = argc > 1 ? strtoul(argv[1], NULL, 0) : 264;
+	size_t max = argc > 2 ? strtoul(argv[2], NULL, 0) : 1024;
+	int rounds = argc > 3 ? atoi(argv[3]) : 2000;
+	uint64_t state = 88172645463325252ULL, bytes = 0;
+	int unaligned16 = 0, unaligned64 = 0;
+	double start;
+	int i, round;
+
+	if (!min || max < min) {
+		fprintf(stderr, "usage: %s [min size] [max size] [rounds]\n", argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < BUFFERS; i++) {
+		sizes[i] = min + next_random(&state) % (max - min + 1);
+		src[i] = os_malloc(sizes[i]);
+		dst[i] = os_malloc(sizes[i]);
+		unaligned16 += ((uintptr_t)src[i] & 15) != 0;
+		unaligned64 += ((uintptr_t)src[i] & 63) != 0;
+		memset(src[i], i, sizes[i]);
+	}
+
+	start = now();
+	for (round = 0; round < rounds; round++) {
+		for (i = 0; i < BUFFERS; i++) {
+			memset(dst[i], round, sizes[i]);
+			memcpy(dst[i], src[i], sizes[i]);
+			bytes += 2 * sizes[i];
+		}
+	}
+
+	printf("%zu..%zu bytes: %.3f ns/byte, %d/%d buffers not 16-aligned, %d not 64-aligned\n",
+	       min, max, (now() - start) * 1e9 / bytes, unaligned16, BUFFERS, unaligned64);
+
+	for (i = 0; i < BUFFERS; i++) {
+		os_free(src[i]);
+		os_free(dst[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,284 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+#include "block_meta.h"
+
+// headers and payloads are aligned to ALIGNMENT bytes, 16 by default like
+// the x86-64 ABI asks of malloc(), the Makefile can pick 8, 32 or 64
+#ifndef ALIGNMENT
+#define ALIGNMENT 16
+#endif
+
+_Static_assert(ALIGNMENT == 8 || ALIGNMENT == 16 || ALIGNMENT == 32 || ALIGNMENT == 64,
+	       "ALIGNMENT must be 8, 16, 32 or 64");
+
+// the status keeps STATUS_* in its low bits and the block flags above them
+#define STATUS_MASK 0x3UL
+
+// the previous block on the heap is free and left its size in a boundary tag
+#define BLOCK_PREV_FREE 0x4UL
+
+#ifdef COMPACT_HEADER
+
+// no block follows this one, the heap continues at another address
+#define BLOCK_SEG_END (1UL << 56)
+
+// the block lives in a region of an arena other than the main one
+#define BLOCK_NON_MAIN (1UL << 57)
+
+// the payload came from fresh pages, it is zero but for allocator metadata
+#define BLOCK_ZEROED (1UL << 58)
+
+// the whole pages inside the payload of the free block were dropped with
+// MADV_DONTNEED and read as zero, or given back with MADV_FREE
+#define BLOCK_PURGED (1UL << 59)
+#define BLOCK_LAZY_PURGED (1UL << 60)
+
+// the free block has whole pages that wait on the dirty list to be purged
+#define BLOCK_DIRTY (1UL << 61)
+
+// the size word keeps the status in its low bits and the rare flags in its
+// high byte, block sizes never get close to 2^56
+#define BLOCK_FLAGS (STATUS_MASK | BLOCK_PREV_FREE | (0xffUL << 56))
+
+// compact header: allocated blocks only use size_status, prev_size is the
+// boundary tag of the previous block when that one is free; it is padded to
+// ALIGNMENT so that the payload of an aligned header is aligned too
+struct block {
+	size_t prev_size;
+	size_t size_status;
+} __attribute__((aligned(ALIGNMENT)));
+
+// free blocks are linked in the free lists through their payload
+struct free_links {
+	struct block *prev;
+	struct block *next;
+};
+
+#define MIN_SIZE (sizeof(struct free_links) > ALIGNMENT ? sizeof(struct free_links) : ALIGNMENT)
+
+#else
+
+// no block follows this one, the heap continues at another address
+#define BLOCK_SEG_END 0x8UL
+
+// the block lives in a region of an arena other than the main one
+#define BLOCK_NON_MAIN 0x10UL
+
+// the payload came from fresh pages, it is zero but for allocator metadata
+#define BLOCK_ZEROED 0x20UL
+
+// the whole pages inside the payload of the free block were dropped with
+// MADV_DONTNEED and read as zero, or given back with MADV_FREE
+#define BLOCK_PURGED 0x40UL
+#define BLOCK_LAZY_PURGED 0x80UL
+
+// the free block has whole pages that wait on the dirty list to be purged
+#define BLOCK_DIRTY 0x100UL
+
+// block header of the support code, free blocks are linked in the free
+// lists through its prev and next pointers; it is padded to ALIGNMENT so
+// that the payload of an aligned header is aligned too
+struct block {
+	struct block_meta meta;
+} __attribute__((aligned(ALIGNMENT)));
+
+#define MIN_SIZE ALIGNMENT
+
+#endif
+
+#define META_SIZE (sizeof(struct block))
+
+// align a requested size and make sure a free block could hold it later
+static inline size_t align_size(size_t size)
+{
+	size = (size + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1);
+
+	return size < MIN_SIZE ? MIN_SIZE : size;
+}
+
+static inline void *block_payload(struct block *block)
+{
+	return (void *)(block + 1);
+}
+
+static inline struct block *payload_block(void *ptr)
+{
+	return (struct block *)ptr - 1;
+}
+
+#ifdef COMPACT_HEADER
+
+static inline size_t block_size(struct block *block)
+{
+	return block->size_status & ~BLOCK_FLAGS;
+}
+
+static inline void set_block_size(struct block *block, size_t size)
+{
+	block->size_status = (block->size_status & BLOCK_FLAGS) | size;
+}
+
+static inline int block_status(struct block *block)
+{
+	return block->size_status & STATUS_MASK;
+}
+
+static inline void set_status(struct block *block, int status)
+{
+	block->size_status = (block->size_status & ~STATUS_MASK) | status;
+}
+
+static inline int test_flag(struct block *block, unsigned long flag)
+{
+	return !!(block->size_status & flag);
+}
+
+static inline void set_flag(struct block *block, unsigned long flag)
+{
+	block->size_status |= flag;
+}
+
+static inline void clear_flag(struct block *block, unsigned long flag)
+{
+	block->size_status &= ~flag;
+}
+
+// sets up a new block header with no flags
+static inline void init_block(struct block *block, size_t size, int status)
+{
+	block->size_status = size | status;
+}
+
+// the boundary tag of a free block is the prev_size word of its successor
+static inline void set_boundary_tag(struct block *block, struct block *next)
+{
+	next->prev_size = block_size(block);
+}
+
+static inline size_t prev_size(struct block *block)
+{
+	return block->prev_size;
+}
+
+static inline struct block *free_prev(struct block *block)
+{
+	return ((struct free_links *)block_payload(block))->prev;
+}
+
+static inline struct block *free_next(struct block *block)
+{
+	return ((struct free_links *)block_payload(block))->next;
+}
+
+static inline void set_free_prev(struct block *block, struct block *prev)
+{
+	((struct free_links *)block_payload(block))->prev = prev;
+}
+
+static inline void set_free_next(struct block *block, struct block *next)
+{
+	((struct free_links *)block_payload(block))->next = next;
+}
+
+// a mapped block has no previous block, its prev_size word keeps the start
+// of its mapping
+static inline void *map_start(struct block *block)
+{
+	return (void *)block->prev_size;
+}
+
+static inline void set_map_start(struct block *block, void *start)
+{
+	block->prev_size = (size_t)start;
+}
+
+#else
+
+static inline size_t block_size(struct block *block)
+{
+	return block->meta.size;
+}
+
+static inline void set_block_size(struct block *block, size_t size)
+{
+	block->meta.size = size;
+}
+
+static inline int block_status(struct block *block)
+{
+	return block->meta.status & STATUS_MASK;
+}
+
+static inline void set_status(struct block *block, int status)
+{
+	block->meta.status = (block->meta.status & ~STATUS_MASK) | status;
+}
+
+static inline int test_flag(struct block *block, unsigned long flag)
+{
+	return !!(block->meta.status & flag);
+}
+
+static inline void set_flag(struct block *block, unsigned long flag)
+{
+	block->meta.status |= flag;
+}
+
+static inline void clear_flag(struct block *block, unsigned long flag)
+{
+	block->meta.status &= ~flag;
+}
+
+// sets up a new block header with no flags
+static inline void init_block(struct block *block, size_t size, int status)
+{
+	block->meta.size = size;
+	block->meta.status = status;
+}
+
+// the boundary tag of a free block is the last word of its payload
+static inline void set_boundary_tag(struct block *block, struct block *next)
+{
+	*((size_t *)next - 1) = block_size(block);
+}
+
+static inline size_t prev_size(struct block *block)
+{
+	return *((size_t *)block - 1);
+}
+
+static inline struct block *free_prev(struct block *block)
+{
+	return (struct block *)block->meta.prev;
+}
+
+static inline struct block *free_next(struct block *block)
+{
+	return (struct block *)block->meta.next;
+}
+
+static inline void set_free_prev(struct block *block, struct block *prev)
+{
+	block->meta.prev = (struct block_meta *)prev;
+}
+
+static inline void set_free_next(struct block *block, struct block *next)
+{
+	block->meta.next = (struct block_meta *)next;
+}
+
+// a mapped block is never linked in a free list, its prev pointer keeps the
+// start of its mapping
+static inline void *map_start(struct block *block)
+{
+	return block->meta.prev;
+}
+
+static inline void set_map_start(struct block *block, void *start)
+{
+	block->meta.prev = start;
+}
+
+#endif
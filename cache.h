@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+#include <stddef.h>
+
+// the cache in front of the arenas keeps recently freed objects, it is
+// either per thread (tcache.c) or per CPU (percpu.c)
+
+// return a cached object for an aligned size, refilling the cache from the
+// heap if needed, or NULL if objects of that size are not cached
+void *cache_alloc(size_t size);
+
+// keep an object of size bytes in the cache, return 0 if it was not
+// cached and has to be freed on the heap
+int cache_free(void *ptr, size_t size);
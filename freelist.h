@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+#include <stddef.h>
+#include "block.h"
+
+// every arena has its own index, laid out by the engine
+#ifdef ENGINE_TLSF
+#include "tlsf.h"
+#else
+#include "seglist.h"
+#endif
+
+// add a free block to the index
+void freelist_insert(struct freelist *list, struct block *block);
+
+// remove a free block from the index, before its size or status changes
+void freelist_remove(struct freelist *list, struct block *block);
+
+// return the smallest indexed free block of at least size bytes, or NULL
+struct block *freelist_find(struct freelist *list, size_t size);
@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+#include <stddef.h>
+#include <pthread.h>
+#include "freelist.h"
+#include "slab.h"
+
+struct remote_free;
+struct dirty_block;
+
+// size and alignment of a transparent huge page
+#define THP_SIZE (2UL << 20)
+
+// the decay time is cut in DECAY_STEPS steps
+#define DECAY_STEPS 20
+
+// dirty pages of an arena: whole pages of free blocks that were not purged,
+// they are purged as they get older, along the decay curve
+struct decay {
+	// dirty free blocks, from the oldest to the most recently freed
+	struct dirty_block *oldest;
+	struct dirty_block *newest;
+	// bytes in the whole pages of the dirty blocks
+	size_t dirty;
+	// bytes made dirty during each of the last steps, newest first
+	size_t backlog[DECAY_STEPS];
+	// start of the current step, in milliseconds
+	unsigned long epoch;
+};
+
+// counters of an arena, changed under its lock
+struct arena_stats {
+	// bytes of the blocks of the heap, headers included, and their number
+	size_t heap_bytes;
+	size_t blocks;
+	// payload bytes of the free blocks and their number
+	size_t free_bytes;
+	size_t free_blocks;
+	size_t splits;
+	size_t coalesces;
+};
+
+// the heap is split in arenas that threads use independently, every arena
+// has its own lock, blocks, free index and slab runs
+struct arena {
+	pthread_mutex_t lock;
+	// objects freed by threads using another arena, pushed without locking
+	struct remote_free *remote_free;
+	// threads using the arena, changed under the arenas lock; an arena left
+	// by all of them is abandoned until another thread adopts it
+	unsigned int users;
+	int abandoned;
+	// first block and top block of the heap of the arena
+	void *base;
+	struct block *last;
+	// flags set on every block of the arena
+	unsigned long block_flags;
+	// heap break of an arena that grows inside mapped regions
+	char *brk;
+	char *end;
+	struct freelist freelist;
+	struct slab_cache slab;
+	struct decay decay;
+	struct arena_stats stats;
+};
+
+// return the arena of the calling thread, locked, after freeing the objects
+// other threads left on its remote free stack
+struct arena *arena_get(void);
+
+// return the arena owning a slab object or a heap block
+struct arena *arena_of(void *ptr);
+
+// free the objects of the arena linked through their first word from first
+// to last, the arena of the calling thread or any arena that is not locked
+// frees them right away, while busy arenas get them on their remote free
+// stack with a single CAS
+void arena_free(struct arena *arena, void *first, void *last);
+
+// free a NULL-terminated list of objects of any arena linked through their
+// first word, consecutive objects of the same arena are freed together
+void arena_free_list(void *list);
+
+static inline void arena_lock(struct arena *arena)
+{
+	pthread_mutex_lock(&arena->lock);
+}
+
+static inline void arena_unlock(struct arena *arena)
+{
+	pthread_mutex_unlock(&arena->lock);
+}
+
+// add up the counters of every arena in sum
+void arena_stats(struct arena_stats *sum);
+
+// map len bytes aligned to align, which is a power of two
+void *map_aligned(size_t len, size_t align, int flags);
+
+// move the heap break of the arena like sbrk() does, the memory returned
+// does not follow the old break if the arena had to move somewhere else
+void *arena_sbrk(struct arena *arena, size_t increment);
+
+// grow the heap of the arena in place if it still ends at end,
+// return 0 on success and -1 otherwise
+int arena_grow(struct arena *arena, void *end, size_t increment);
+
+// give the decrement bytes before end back to the system if the heap of the
+// arena still ends at end, return 0 on success and -1 otherwise
+int arena_trim(struct arena *arena, void *end, size_t decrement);
+
+// allocate size bytes, size is aligned and below the mmap threshold,
+// the arena must be locked
+void *heap_malloc(struct arena *arena, size_t size);
+
+// give a slab object or heap block back to its arena, which must be locked
+void heap_free(struct arena *arena, void *ptr);
+
+// purge the dirty pages of the arena that are older than the decay curve
+// allows, the arena must be locked
+void heap_decay(struct arena *arena);
+
+// purge every dirty page of the arena, which must be locked; returns 1 if
+// there was any
+int heap_purge(struct arena *arena);
+
+// shrink the free block at the top of the heap of the arena to pad bytes,
+// rounded up to a page, the arena must be locked; returns 1 if memory was
+// given back to the system
+int heap_trim(struct arena *arena, size_t pad);
@@ -0,0 +1,266 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "osmem.h"
+#include "osmem_ext.h"
+#include "histogram.h"
+
+// log-linear buckets: the values below HIST_SUB have one each, and every
+// power of two above is split in HIST_SUB buckets
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+// one allocation in LIFETIME_SAMPLE has its birth kept in a table of
+// LIFETIME_SLOTS entries, looked up over LIFETIME_PROBES of them; a sample
+// is dropped when its slots are taken
+#define LIFETIME_SAMPLE 16
+#define LIFETIME_SLOTS 4096
+#define LIFETIME_PROBES 8
+
+// a dump is formatted into a buffer of DUMP_BUFFER bytes, since stdio may
+// allocate
+#define DUMP_BUFFER 4096
+
+struct histogram {
+	unsigned long counts[HIST_BUCKETS];
+};
+
+struct birth {
+	void *ptr;
+	// allocations made before ptr
+	unsigned long tick;
+};
+
+struct dump {
+	int fd;
+	int error;
+	size_t len;
+	char buf[DUMP_BUFFER];
+};
+
+// sizes asked for, new sizes in percent of the usable ones for
+// os_realloc(), and lifetimes counted in allocations
+static struct histogram sizes;
+static struct histogram ratios;
+static struct histogram lifetimes;
+
+static struct birth births[LIFETIME_SLOTS];
+static unsigned long ticks;
+
+static unsigned int hist_bucket(unsigned long value)
+{
+	unsigned int shift;
+
+	if (value < HIST_SUB)
+		return value;
+
+	// the bits below the HIST_SUB_BITS after the leading one are dropped
+	shift = 63 - __builtin_clzl(value) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (value >> shift) - HIST_SUB;
+}
+
+// smallest value of a bucket
+static unsigned long bucket_min(unsigned int bucket)
+{
+	unsigned int shift;
+
+	if (bucket < HIST_SUB)
+		return bucket;
+
+	shift = bucket / HIST_SUB - 1;
+	return (unsigned long)(HIST_SUB + bucket % HIST_SUB) << shift;
+}
+
+static void hist_add(struct histogram *hist, unsigned long value, unsigned long n)
+{
+	__atomic_add_fetch(&hist->counts[hist_bucket(value)], n, __ATOMIC_RELAXED);
+}
+
+static struct birth *birth_slot(void *ptr, unsigned int i)
+{
+	uint64_t hash = ((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL;
+
+	return &births[((hash >> 52) + i) & (LIFETIME_SLOTS - 1)];
+}
+
+static void birth_record(void *ptr, unsigned long tick)
+{
+	struct birth *birth;
+	void *empty;
+	unsigned int i;
+
+	for (i = 0; i < LIFETIME_PROBES; i++) {
+		birth = birth_slot(ptr, i);
+		empty = NULL;
+		if (__atomic_compare_exchange_n(&birth->ptr, &empty, ptr, 0,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&birth->tick, tick, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+}
+
+void hist_alloc(void *ptr, size_t size)
+{
+	unsigned long tick = __atomic_fetch_add(&ticks, 1, __ATOMIC_RELAXED);
+
+	hist_add(&sizes, size, 1);
+	if (ptr && tick % LIFETIME_SAMPLE == 0)
+		birth_record(ptr, tick);
+}
+
+void hist_alloc_batch(void **ptrs, size_t n, size_t size)
+{
+	unsigned long tick = __atomic_fetch_add(&ticks, n, __ATOMIC_RELAXED);
+	size_t i;
+
+	hist_add(&sizes, size, n);
+	for (i = 0; i < n; i++) {
+		if (ptrs[i] && (tick + i) % LIFETIME_SAMPLE == 0)
+			birth_record(ptrs[i], tick + i);
+	}
+}
+
+void hist_realloc(void *ptr, size_t size)
+{
+	size_t old_size = os_malloc_usable_size(ptr);
+	double ratio;
+
+	if (!old_size)
+		return;
+
+	ratio = (double)size * 100 / old_size;
+	hist_add(&ratios, ratio < ULONG_MAX ? ratio : ULONG_MAX, 1);
+}
+
+// takes the birth of ptr out of the table, returns 0 if it was not sampled
+static int birth_take(void *ptr, unsigned long *tick)
+{
+	struct birth *birth;
+	void *found;
+	unsigned int i;
+
+	for (i = 0; i < LIFETIME_PROBES; i++) {
+		birth = birth_slot(ptr, i);
+		found = ptr;
+		if (__atomic_load_n(&birth->ptr, __ATOMIC_RELAXED) != ptr)
+			continue;
+
+		*tick = __atomic_load_n(&birth->tick, __ATOMIC_RELAXED);
+		return __atomic_compare_exchange_n(&birth->ptr, &found, NULL, 0,
+						   __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+void hist_move(void *ptr, void *dest)
+{
+	unsigned long tick;
+
+	if (dest && birth_take(ptr, &tick))
+		birth_record(dest, tick);
+}
+
+void hist_free(void *ptr)
+{
+	unsigned long tick;
+
+	if (birth_take(ptr, &tick))
+		hist_add(&lifetimes, __atomic_load_n(&ticks, __ATOMIC_RELAXED) - tick, 1);
+}
+
+static void dump_flush(struct dump *dump)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (!dump->error && done < dump->len) {
+		n = write(dump->fd, dump->buf + done, dump->len - done);
+		if (n < 0)
+			dump->error = 1;
+		else
+			done += n;
+	}
+
+	dump->len = 0;
+}
+
+// every call prints less than 128 bytes
+static void dump_printf(struct dump *dump, const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	if (DUMP_BUFFER - dump->len < 128)
+		dump_flush(dump);
+
+	va_start(args, fmt);
+	n = vsnprintf(dump->buf + dump->len, DUMP_BUFFER - dump->len, fmt, args);
+	va_end(args);
+	if (n > 0)
+		dump->len += n;
+}
+
+// the buckets in use as [min, max, count] triples
+static void dump_histogram(struct dump *dump, const char *name, struct histogram *hist)
+{
+	unsigned long count, max;
+	const char *sep = "";
+	unsigned int i;
+
+	dump_printf(dump, ",\n  \"%s\": [", name);
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		count = __atomic_load_n(&hist->counts[i], __ATOMIC_RELAXED);
+		if (!count)
+			continue;
+
+		max = i + 1 < HIST_BUCKETS ? bucket_min(i + 1) - 1 : ULONG_MAX;
+		dump_printf(dump, "%s[%lu, %lu, %lu]", sep, bucket_min(i), max, count);
+		sep = ", ";
+	}
+	dump_printf(dump, "]");
+}
+
+int os_histogram_dump(int fd)
+{
+	struct dump dump = { .fd = fd };
+
+	dump_printf(&dump, "{\n  \"allocations\": %lu,\n  \"lifetime_sample\": %lu",
+		    __atomic_load_n(&ticks, __ATOMIC_RELAXED), (unsigned long)LIFETIME_SAMPLE);
+	dump_histogram(&dump, "sizes", &sizes);
+	dump_histogram(&dump, "realloc_percent", &ratios);
+	dump_histogram(&dump, "lifetimes", &lifetimes);
+	dump_printf(&dump, "\n}\n");
+	dump_flush(&dump);
+
+	return dump.error ? -1 : 0;
+}
+
+static const char *dump_path;
+
+static void hist_exit(void)
+{
+	int fd = open(dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0)
+		return;
+
+	os_histogram_dump(fd);
+	close(fd);
+}
+
+// OSMEM_HISTOGRAM_FILE names the file the histograms are written to at exit
+static void __attribute__((constructor)) hist_init(void)
+{
+	dump_path = getenv("OSMEM_HISTOGRAM_FILE");
+	if (dump_path)
+		atexit(hist_exit);
+}
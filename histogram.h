@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+#include <stddef.h>
+
+// histograms of the sizes asked for, of the growth of os_realloc() and of
+// the lifetimes of the objects, kept only in a build with HISTOGRAM=1
+
+// every public entry point records one sample, the allocations of the
+// allocator itself, for pools and regions or to move an object, go through
+// these instead and are not recorded
+void *internal_malloc(size_t size);
+void *internal_calloc(size_t nmemb, size_t size);
+void *internal_memalign(size_t alignment, size_t size);
+void internal_free(void *ptr);
+
+#ifdef HISTOGRAM
+
+// record an allocation of size bytes at ptr, one in a few has its birth
+// recorded to measure its lifetime
+void hist_alloc(void *ptr, size_t size);
+
+// record the n objects of size bytes allocated at once in ptrs
+void hist_alloc_batch(void **ptrs, size_t n, size_t size);
+
+// record ptr being resized to size bytes
+void hist_realloc(void *ptr, size_t size);
+
+// record the object at ptr moved to dest, its birth follows it
+void hist_move(void *ptr, void *dest);
+
+// record ptr being freed, the lifetime is known if its birth was recorded
+void hist_free(void *ptr);
+
+#else
+
+static inline void hist_alloc(void *ptr, size_t size)
+{
+	(void)ptr;
+	(void)size;
+}
+
+static inline void hist_alloc_batch(void **ptrs, size_t n, size_t size)
+{
+	(void)ptrs;
+	(void)n;
+	(void)size;
+}
+
+static inline void hist_realloc(void *ptr, size_t size)
+{
+	(void)ptr;
+	(void)size;
+}
+
+static inline void hist_move(void *ptr, void *dest)
+{
+	(void)ptr;
+	(void)dest;
+}
+
+static inline void hist_free(void *ptr)
+{
+	(void)ptr;
+}
+
+#endif
@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "block_meta.h"
+#include "clock.h"
+#include "mmap_cache.h"
+#include "options.h"
+#include "stats.h"
+
+#define MMAP_CACHE_SLOTS 64
+
+struct cached_chunk {
+	void *addr;
+	size_t len;
+	// time the chunk was freed, in milliseconds
+	unsigned long time;
+};
+
+// chunks are ordered from the oldest to the most recently freed one
+static struct cached_chunk chunks[MMAP_CACHE_SLOTS];
+static unsigned int nr_chunks;
+static size_t cached_bytes;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void remove_chunk(unsigned int i)
+{
+	cached_bytes -= chunks[i].len;
+	nr_chunks--;
+	memmove(&chunks[i], &chunks[i + 1], (nr_chunks - i) * sizeof(chunks[0]));
+}
+
+// moves the oldest chunks to victims until the cache can take len more
+// bytes, chunks older than the age limit always go
+static unsigned int evict(size_t len, unsigned long now, struct cached_chunk *victims)
+{
+	unsigned int n = 0;
+
+	while (nr_chunks && (now - chunks[0].time > (unsigned long)options.mmap_cache_age_ms ||
+			     nr_chunks + !!len > MMAP_CACHE_SLOTS ||
+			     cached_bytes + len > (size_t)options.mmap_cache_max)) {
+		victims[n++] = chunks[0];
+		remove_chunk(0);
+	}
+
+	return n;
+}
+
+// unmapping happens after the cache lock is dropped
+static void unmap_victims(struct cached_chunk *victims, unsigned int n)
+{
+	int error;
+
+	while (n--) {
+		error = munmap(victims[n].addr, victims[n].len);
+		DIE(error == -1, "munmap failed!");
+		stat_add(&stats.munmap_calls, 1);
+		stat_footprint(-(long)victims[n].len);
+	}
+}
+
+void *mmap_cache_get(size_t len)
+{
+	struct cached_chunk victims[MMAP_CACHE_SLOTS];
+	void *addr = NULL;
+	unsigned int i, n;
+
+	pthread_mutex_lock(&cache_lock);
+	n = evict(0, now_ms(), victims);
+
+	// the most recently freed chunk is the most likely to be resident
+	for (i = nr_chunks; i-- > 0;) {
+		if (chunks[i].len == len) {
+			addr = chunks[i].addr;
+			remove_chunk(i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	unmap_victims(victims, n);
+	return addr;
+}
+
+void mmap_cache_put(void *addr, size_t len)
+{
+	struct cached_chunk victims[MMAP_CACHE_SLOTS + 1];
+	unsigned long now = now_ms();
+	unsigned int n = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	// a chunk bigger than the whole cache is unmapped right away
+	if (len <= (size_t)options.mmap_cache_max) {
+		n = evict(len, now, victims);
+		chunks[nr_chunks].addr = addr;
+		chunks[nr_chunks].len = len;
+		chunks[nr_chunks].time = now;
+		nr_chunks++;
+		cached_bytes += len;
+		addr = NULL;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	if (addr) {
+		victims[n].addr = addr;
+		victims[n].len = len;
+		n++;
+	}
+	unmap_victims(victims, n);
+}
+
+int mmap_cache_trim(void)
+{
+	struct cached_chunk victims[MMAP_CACHE_SLOTS];
+	unsigned int n = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	while (nr_chunks) {
+		victims[n++] = chunks[0];
+		remove_chunk(0);
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	unmap_victims(victims, n);
+	return n > 0;
+}
+
+void mmap_cache_lock(void)
+{
+	pthread_mutex_lock(&cache_lock);
+}
+
+void mmap_cache_unlock(void)
+{
+	pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+#include <stddef.h>
+
+// return a freed chunk of exactly len bytes to reuse, or NULL
+void *mmap_cache_get(size_t len);
+
+// keep a chunk of len bytes for reuse, or unmap it if it does not fit
+void mmap_cache_put(void *addr, size_t len);
+
+// unmap every cached chunk, returns 1 if there was any
+int mmap_cache_trim(void);
+
+// take and release the cache lock around fork(), so that the child does not
+// inherit it held by a thread it does not have
+void mmap_cache_lock(void);
+void mmap_cache_unlock(void);
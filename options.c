@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <limits.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include "block.h"
+#include "options.h"
+
+struct options options = {
+	.mmap_cache_max = 64L << 20,
+	.mmap_cache_age_ms = 1000,
+	.mmap_threshold = 128 * 1024,
+	.mmap_threshold_max = MMAP_THRESHOLD_LIMIT,
+	.trim_threshold = 128 * 1024,
+	.purge_lazy = 1,
+	.decay_ms = 10000,
+	.alignment = ALIGNMENT,
+};
+
+struct option {
+	int param;
+	const char *name;
+	long *value;
+	long max;
+};
+
+static const struct option option_table[] = {
+	{ OSMEM_MMAP_CACHE_MAX, "OSMEM_MMAP_CACHE_MAX", &options.mmap_cache_max, LONG_MAX },
+	{ OSMEM_MMAP_CACHE_AGE_MS, "OSMEM_MMAP_CACHE_AGE_MS", &options.mmap_cache_age_ms, LONG_MAX },
+	{ OSMEM_MMAP_THRESHOLD, "OSMEM_MMAP_THRESHOLD", &options.mmap_threshold, MMAP_THRESHOLD_LIMIT },
+	{ OSMEM_MMAP_THRESHOLD_MAX, "OSMEM_MMAP_THRESHOLD_MAX", &options.mmap_threshold_max,
+	  MMAP_THRESHOLD_LIMIT },
+	{ OSMEM_TRIM_THRESHOLD, "OSMEM_TRIM_THRESHOLD", &options.trim_threshold, LONG_MAX },
+	{ OSMEM_PURGE_LAZY, "OSMEM_PURGE_LAZY", &options.purge_lazy, 1 },
+	{ OSMEM_DECAY_MS, "OSMEM_DECAY_MS", &options.decay_ms, LONG_MAX },
+	{ OSMEM_BACKGROUND_PURGE, "OSMEM_BACKGROUND_PURGE", &options.background_purge, 1 },
+	{ OSMEM_THP, "OSMEM_THP", &options.thp, 1 },
+	{ OSMEM_ALIGNMENT, "OSMEM_ALIGNMENT", &options.alignment, 64 },
+};
+
+#define NR_OPTIONS (sizeof(option_table) / sizeof(option_table[0]))
+
+int os_mallopt(int param, long value)
+{
+	size_t i;
+
+	if (value < 0)
+		return 0;
+
+	for (i = 0; i < NR_OPTIONS; i++) {
+		if (option_table[i].param == param) {
+			if (value > option_table[i].max)
+				return 0;
+
+			// the runtime alignment is a power of two, at least 8
+			if (param == OSMEM_ALIGNMENT && (value < 8 || (value & (value - 1))))
+				return 0;
+
+			if (param == OSMEM_MMAP_THRESHOLD || param == OSMEM_TRIM_THRESHOLD)
+				__atomic_store_n(&options.mmap_threshold_fixed, 1, __ATOMIC_RELAXED);
+			__atomic_store_n(option_table[i].value, value, __ATOMIC_RELAXED);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// the environment overrides the defaults before main() runs
+static void __attribute__((constructor)) options_init(void)
+{
+	const char *env;
+	char *end;
+	long value;
+	size_t i;
+
+	for (i = 0; i < NR_OPTIONS; i++) {
+		env = getenv(option_table[i].name);
+		if (!env)
+			continue;
+
+		value = strtol(env, &end, 0);
+		if (end != env && !*end)
+			os_mallopt(option_table[i].param, value);
+	}
+}
@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+#include "osmem_ext.h"
+
+// heap blocks have to fit in a region of an arena, so requests above this
+// size are always served by mmap()
+#define MMAP_THRESHOLD_LIMIT (32L << 20)
+
+// current values of the os_mallopt() parameters
+struct options {
+	long mmap_cache_max;
+	long mmap_cache_age_ms;
+	// read and written with atomics, freeing mapped blocks raises it
+	long mmap_threshold;
+	long mmap_threshold_max;
+	long trim_threshold;
+	long purge_lazy;
+	long decay_ms;
+	long background_purge;
+	long thp;
+	long alignment;
+	// set once a threshold is chosen with os_mallopt()
+	int mmap_threshold_fixed;
+};
+
+extern struct options options;
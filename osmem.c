@@ -1,174 +1,766 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include <errno.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <assert.h>
 #include <sys/mman.h>
 #include <string.h>
 #include "osmem.h"
 #include "block_meta.h"
+#include "heap.h"
+#include "cache.h"
+#include "mmap_cache.h"
+#include "options.h"
+#include "stats.h"
+#include "histogram.h"
+#include "clock.h"
+#include "osmem_ext.h"
+
+// bytes taken from the heap when an arena is first used
+#define PREALLOC_SIZE (128 * 1024)
+
+void *try_split(struct arena *arena, struct block *best_fit_block, size_t size);
+
+// returns the block that follows the given one on the heap, if any
+static struct block *next_block(struct arena *arena, struct block *block)
+{
+	if (block == arena->last || test_flag(block, BLOCK_SEG_END))
+		return NULL;
 
-#define META_SIZE (sizeof(struct block_meta))
-#define MMAP_THRESHOLD (128 * 1024)
-#define ALIGNMENT 8
+	return (struct block *)((char *)block_payload(block) + block_size(block));
+}
 
-struct block_meta *last;
-void *global_base;
+// returns the block that precedes the given one on the heap, if it is free
+static struct block *prev_free_block(struct block *block)
+{
+	if (!test_flag(block, BLOCK_PREV_FREE))
+		return NULL;
 
-// preallocate a big chunck of memory
-void *preallocate(size_t size)
+	return (struct block *)((char *)block - prev_size(block) - META_SIZE);
+}
+
+// sets up a new block on the heap of the arena
+static void new_block(struct arena *arena, struct block *block, size_t size, int status)
 {
-	void *request = sbrk(MMAP_THRESHOLD);
-	struct block_meta *block = NULL;
+	init_block(block, size, status);
+	set_flag(block, arena->block_flags);
+	arena->stats.blocks++;
+}
 
-	DIE((void *)request == (void *)-1, "Preallocation failed");
-	block = (struct block_meta *)request;
-	block->size = size;
-	block->status = 1;
+// links of a free block on the dirty list of its arena
+struct dirty_block {
+	struct dirty_block *prev;
+	struct dirty_block *next;
+};
+
+// the whole pages of the payload, except for the free list and dirty list
+// links at its start and the boundary tag in its last word
+static void purge_range(struct block *block, char **first, char **last)
+{
+	uintptr_t page_size = getpagesize();
+	uintptr_t start = (uintptr_t)block_payload(block);
+	uintptr_t links = MIN_SIZE + sizeof(struct dirty_block);
+
+	*first = (char *)((start + links + page_size - 1) & ~(page_size - 1));
+	*last = (char *)((start + block_size(block) - sizeof(size_t)) & ~(page_size - 1));
+}
+
+// MADV_FREE needs Linux 4.5, older kernels only know MADV_DONTNEED
+static int lazy_purge_unsupported;
+
+// gives the whole pages of a free block back to the system, the block
+// keeps its place on the heap and in the free index
+static void purge_block(struct block *block)
+{
+	char *first, *last;
+
+	// fresh pages were never touched, purged ones are already given back
+	if (test_flag(block, BLOCK_ZEROED | BLOCK_PURGED | BLOCK_LAZY_PURGED))
+		return;
+
+	purge_range(block, &first, &last);
+	if (first >= last)
+		return;
+
+	if (__atomic_load_n(&options.purge_lazy, __ATOMIC_RELAXED) &&
+	    !__atomic_load_n(&lazy_purge_unsupported, __ATOMIC_RELAXED)) {
+		if (!madvise(first, last - first, MADV_FREE)) {
+			set_flag(block, BLOCK_LAZY_PURGED);
+			return;
+		}
+		__atomic_store_n(&lazy_purge_unsupported, 1, __ATOMIC_RELAXED);
+	}
 
-	block->next = NULL;
-	block->prev = NULL;
+	madvise(first, last - first, MADV_DONTNEED);
+	set_flag(block, BLOCK_PURGED);
+}
 
-	global_base = block;
-	last = block;
+// dirty blocks are linked after their free list links
+static struct dirty_block *dirty_links(struct block *block)
+{
+	return (struct dirty_block *)((char *)block_payload(block) + MIN_SIZE);
+}
 
-	return (void *)(block + 1);
+static struct block *dirty_to_block(struct dirty_block *dirty)
+{
+	return payload_block((char *)dirty - MIN_SIZE);
 }
 
-// creates a block of memory with a size equal to the parameter given using mmap
-void *request_mmap(size_t size)
+// bytes a free block would give back if it was purged
+static size_t dirty_size(struct block *block)
 {
-	struct block_meta *block = NULL;
+	char *first, *last;
 
-	void *request = mmap(NULL, size + META_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	purge_range(block, &first, &last);
+	return first < last ? last - first : 0;
+}
 
-	DIE(request == (void *)-1, "mmap failed");
+// queues the whole pages of a new free block to be purged later
+static void mark_dirty(struct arena *arena, struct block *block)
+{
+	struct decay *decay = &arena->decay;
+	struct dirty_block *dirty;
+	size_t size;
 
-	block = (struct block_meta *)request;
-	block->size = size;
-	block->status = 2;
+	if (test_flag(block, BLOCK_ZEROED | BLOCK_PURGED | BLOCK_LAZY_PURGED))
+		return;
 
-	return (void *)(block + 1);
+	size = dirty_size(block);
+	if (!size)
+		return;
+
+	if (!__atomic_load_n(&options.decay_ms, __ATOMIC_RELAXED)) {
+		purge_block(block);
+		return;
+	}
+
+	// the curve starts over once every dirty page is gone
+	if (!decay->newest) {
+		memset(decay->backlog, 0, sizeof(decay->backlog));
+		decay->epoch = now_ms();
+	}
+
+	dirty = dirty_links(block);
+	dirty->prev = decay->newest;
+	dirty->next = NULL;
+	if (decay->newest)
+		decay->newest->next = dirty;
+	else
+		decay->oldest = dirty;
+	decay->newest = dirty;
+
+	decay->dirty += size;
+	decay->backlog[0] += size;
+	set_flag(block, BLOCK_DIRTY);
 }
 
-// search the whole list of blocks and returns the best fitting free block
-struct block_meta *find_best_block(size_t size)
+// takes a free block off the dirty list, its pages stay as they are
+static void clear_dirty(struct arena *arena, struct block *block)
 {
-	size_t best_fit_size = MMAP_THRESHOLD;
-	struct block_meta *best_fit_block = NULL;
-	struct block_meta *block = global_base;
+	struct decay *decay = &arena->decay;
+	struct dirty_block *dirty = dirty_links(block);
 
-	while (block) {
-		if (block->status == 0 && block->size >= size) {
-			if (block->size < best_fit_size) {
-				best_fit_block = block;
-				best_fit_size = block->size;
-			}
-		}
-		block = block->next;
+	if (!test_flag(block, BLOCK_DIRTY))
+		return;
+
+	if (dirty->prev)
+		dirty->prev->next = dirty->next;
+	else
+		decay->oldest = dirty->next;
+	if (dirty->next)
+		dirty->next->prev = dirty->prev;
+	else
+		decay->newest = dirty->prev;
+
+	decay->dirty -= dirty_size(block);
+	clear_flag(block, BLOCK_DIRTY);
+}
+
+// purges the oldest dirty blocks until at most limit dirty bytes are left
+static int purge_dirty(struct arena *arena, size_t limit)
+{
+	struct block *block;
+	int purged = 0;
+
+	while (arena->decay.dirty > limit) {
+		block = dirty_to_block(arena->decay.oldest);
+		clear_dirty(arena, block);
+		purge_block(block);
+		purged = 1;
 	}
 
-	return best_fit_block;
+	return purged;
+}
+
+// marks the block as free, writes its boundary tag and indexes it
+static void set_free(struct arena *arena, struct block *block)
+{
+	struct block *next = next_block(arena, block);
+
+	set_status(block, STATUS_FREE);
+	if (next) {
+		set_boundary_tag(block, next);
+		set_flag(next, BLOCK_PREV_FREE);
+	}
+
+	freelist_insert(&arena->freelist, block);
+	arena->stats.free_blocks++;
+	arena->stats.free_bytes += block_size(block);
+	mark_dirty(arena, block);
+}
+
+// takes a free block out of the free index and off the dirty list
+static void unindex_block(struct arena *arena, struct block *block)
+{
+	freelist_remove(&arena->freelist, block);
+	arena->stats.free_blocks--;
+	arena->stats.free_bytes -= block_size(block);
+	clear_dirty(arena, block);
 }
 
-// if it is possible, split the best_fit_block in 2 blocks
-void *try_split(struct block_meta *best_fit_block, size_t size)
+// marks the block as allocated and tells its successor
+static void set_alloc(struct arena *arena, struct block *block)
 {
-	size_t remaining_size = best_fit_block->size - size;
-	struct block_meta *block = NULL;
+	struct block *next = next_block(arena, block);
+
+	set_status(block, STATUS_ALLOC);
+	if (next)
+		clear_flag(next, BLOCK_PREV_FREE);
+}
+
+// merges the next block, which must not be indexed, into the given one,
+// the header of next ends up in the payload, which is no longer zero
+static void absorb_next(struct arena *arena, struct block *block, struct block *next)
+{
+	set_block_size(block, block_size(block) + block_size(next) + META_SIZE);
+	clear_flag(block, BLOCK_ZEROED | BLOCK_PURGED | BLOCK_LAZY_PURGED);
+	arena->stats.blocks--;
+	arena->stats.coalesces++;
+	if (test_flag(next, BLOCK_SEG_END))
+		set_flag(block, BLOCK_SEG_END);
+
+	if (arena->last == next)
+		arena->last = block;
+}
+
+// carves everything after size bytes of the block into a new free block
+static void split_block(struct arena *arena, struct block *block, size_t size)
+{
+	size_t remaining_size = block_size(block) - size;
+	struct block *remaining_block, *next;
 
 	// check if we have enough space for another block
-	if (remaining_size >= (META_SIZE + 1)) {
-		block = (struct block_meta *)((char *)best_fit_block + size + META_SIZE);
+	if (remaining_size < META_SIZE + MIN_SIZE)
+		return;
 
-		block->size = remaining_size - META_SIZE;
-		block->status = 0;
-		block->next = best_fit_block->next;
-		block->prev = best_fit_block;
+	arena->stats.splits++;
+	remaining_block = (struct block *)((char *)block_payload(block) + size);
+	new_block(arena, remaining_block, remaining_size - META_SIZE, STATUS_FREE);
+	if (test_flag(block, BLOCK_SEG_END)) {
+		set_flag(remaining_block, BLOCK_SEG_END);
+		clear_flag(block, BLOCK_SEG_END);
+	}
 
-		best_fit_block->size = size;
-		best_fit_block->status = 1;
+	// the rest of a zeroed or purged free block is zeroed or purged too,
+	// but an allocated block may have been written since it got the flag
+	if (block_status(block) == STATUS_FREE) {
+		if (test_flag(block, BLOCK_ZEROED))
+			set_flag(remaining_block, BLOCK_ZEROED);
+		if (test_flag(block, BLOCK_PURGED))
+			set_flag(remaining_block, BLOCK_PURGED);
+		if (test_flag(block, BLOCK_LAZY_PURGED))
+			set_flag(remaining_block, BLOCK_LAZY_PURGED);
+	}
 
-		if (best_fit_block->next)
-			best_fit_block->next->prev = block;
+	set_block_size(block, size);
 
-		best_fit_block->next = block;
+	if (arena->last == block)
+		arena->last = remaining_block;
 
-		if (block->next == NULL)
-			last = block;
+	// keep free blocks coalesced
+	next = next_block(arena, remaining_block);
+	if (next && block_status(next) == STATUS_FREE) {
+		unindex_block(arena, next);
+		absorb_next(arena, remaining_block, next);
+	}
+
+	set_free(arena, remaining_block);
+}
+
+// preallocate a big chunck of memory and split the first block from it
+void *preallocate(struct arena *arena, size_t size)
+{
+	size_t len = size + META_SIZE > PREALLOC_SIZE ? size + META_SIZE : PREALLOC_SIZE;
+	void *request = arena_sbrk(arena, len);
+	struct block *block = NULL;
+
+	DIE((void *)request == (void *)-1, "Preallocation failed");
+	block = (struct block *)request;
+	new_block(arena, block, len - META_SIZE, STATUS_FREE);
+	set_flag(block, BLOCK_ZEROED);
+
+	arena->base = block;
+	arena->last = block;
+
+	freelist_insert(&arena->freelist, block);
+	arena->stats.free_blocks++;
+	arena->stats.free_bytes += block_size(block);
+	return try_split(arena, block, size);
+}
 
-		return (void *)(best_fit_block + 1);
+// creates a block of memory with a size equal to the parameter given using mmap,
+// the block gets the whole page-rounded chunk so that freed chunks can be reused;
+// its payload is aligned to alignment, after slack that stays mapped
+static void *request_mmap_aligned(size_t alignment, size_t size)
+{
+	struct block *block = NULL;
+	size_t page_size = getpagesize();
+	size_t slack = alignment > ALIGNMENT ? alignment : 0;
+	size_t len = (size + slack + META_SIZE + page_size - 1) & ~(page_size - 1);
+	uintptr_t payload, end;
+	int zeroed = 0, error;
+
+	// a chunk from the cache still holds what its last owner wrote
+	void *request = mmap_cache_get(len);
+
+	if (!request && len >= THP_SIZE && __atomic_load_n(&options.thp, __ATOMIC_RELAXED)) {
+		// only the aligned huge pages of a chunk can be backed by one
+		request = map_aligned(len, THP_SIZE, 0);
+		madvise(request, len, MADV_HUGEPAGE);
+		zeroed = 1;
+	} else if (!request) {
+		request = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		DIE(request == (void *)-1, "mmap failed");
+		stat_add(&stats.mmap_calls, 1);
+		zeroed = 1;
 	}
 
-	best_fit_block->status = 1;
-	return (void *)(best_fit_block + 1);
+	payload = (uintptr_t)request + META_SIZE;
+	if (slack) {
+		payload = (payload + slack - 1) & ~(slack - 1);
+
+		// the slack left after the payload goes back, so that the size of
+		// the block is the one asked for
+		end = (payload + size + page_size - 1) & ~(page_size - 1);
+		if (end < (uintptr_t)request + len) {
+			error = munmap((void *)end, (uintptr_t)request + len - end);
+			DIE(error == -1, "munmap failed!");
+			stat_add(&stats.munmap_calls, 1);
+			if (!zeroed)
+				stat_footprint(-(long)((uintptr_t)request + len - end));
+			len = end - (uintptr_t)request;
+		}
+	}
+
+	// chunks stay in the footprint while they are cached, only a new
+	// mapping adds to it
+	stat_add(&stats.mapped_blocks, 1);
+	stat_add(&stats.mapped_bytes, len);
+	if (zeroed)
+		stat_footprint(len);
+
+	block = payload_block((void *)payload);
+	init_block(block, (uintptr_t)request + len - payload, STATUS_MAPPED);
+	set_map_start(block, request);
+	if (zeroed)
+		set_flag(block, BLOCK_ZEROED);
+
+	return block_payload(block);
 }
 
-// expand the size of the last block to be equal to the given parameter
-void *expand_last(size_t size)
+void *request_mmap(size_t size)
+{
+	return request_mmap_aligned(0, size);
+}
+
+// length of the mapping of a mapped block
+static size_t map_length(struct block *block)
 {
-	size_t real_size = (size_t)sbrk(0) - (size_t)last;
-	size_t new_size = size - real_size + META_SIZE;
+	return (char *)block_payload(block) + block_size(block) - (char *)map_start(block);
+}
 
-	new_size = (new_size + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1);
+// look up the best fitting free block in the segregated free lists
+struct block *find_best_block(struct arena *arena, size_t size)
+{
+	return freelist_find(&arena->freelist, size);
+}
 
-	void *request = sbrk(new_size);
+// if it is possible, split the free best_fit_block in 2 blocks
+void *try_split(struct arena *arena, struct block *best_fit_block, size_t size)
+{
+	unindex_block(arena, best_fit_block);
+	split_block(arena, best_fit_block, size);
+	set_alloc(arena, best_fit_block);
 
-	DIE(request == (void *)-1, "sbrk failed");
+	return block_payload(best_fit_block);
+}
 
-	last->size = size;
-	last->status = 1;
+// expand the size of the last block to be equal to the given parameter
+void *expand_last(struct arena *arena, size_t size)
+{
+	struct block *last = arena->last;
+	void *end = (char *)block_payload(last) + block_size(last);
+
+	// the heap must still end with the last block for it to grow
+	if (arena_grow(arena, end, size - block_size(last)))
+		return NULL;
 
-	return (void *)(last + 1);
+	// the new pages are zero, so a zeroed free block stays zeroed, but
+	// the end of a purged one is not
+	if (block_status(last) == STATUS_FREE)
+		unindex_block(arena, last);
+	clear_flag(last, BLOCK_PURGED | BLOCK_LAZY_PURGED);
+
+	set_block_size(last, size);
+	set_status(last, STATUS_ALLOC);
+
+	return block_payload(last);
 }
 
 // creates a new block with size equal to the given parameter
-void *create_new_block(size_t size)
+void *create_new_block(struct arena *arena, size_t size)
 {
-	void *request = sbrk(size + META_SIZE);
+	struct block *last = arena->last;
+	void *end = (char *)block_payload(last) + block_size(last);
+	void *request = arena_sbrk(arena, size + META_SIZE);
 
 	DIE(request == (void *)-1, "sbrk failed");
 
-	struct block_meta *block = (struct block_meta *)request;
+	struct block *block = (struct block *)request;
 
-	block->size = size;
-	block->status = 1;
+	new_block(arena, block, size, STATUS_ALLOC);
+	set_flag(block, BLOCK_ZEROED);
 
-	last->next = block;
-	block->prev = last;
-	block->next = NULL;
+	// the old last block has no successor if the heap is not contiguous
+	if (request != end) {
+		set_flag(last, BLOCK_SEG_END);
+	} else if (block_status(last) == STATUS_FREE) {
+		set_boundary_tag(last, block);
+		set_flag(block, BLOCK_PREV_FREE);
+	}
 
-	last = block;
+	arena->last = block;
 
-	return (void *)(block + 1);
+	return block_payload(block);
 }
 
-void *os_malloc(size_t size)
+// allocates a block with a header on the heap of the arena
+static void *block_malloc(struct arena *arena, size_t size)
+{
+	void *ptr;
+
+	// if the arena has no heap yet, we have to make the preallocation
+	if (!arena->base)
+		return preallocate(arena, size);
+	// we try to find the best free block
+	struct block *best_fit_block = find_best_block(arena, size);
+
+	// if we find a free block, we try to split it
+	if (best_fit_block)
+		return try_split(arena, best_fit_block, size);
+
+	// if the last block is free, we expand it
+	if (block_status(arena->last) == STATUS_FREE && block_size(arena->last) < size) {
+		ptr = expand_last(arena, size);
+		if (ptr)
+			return ptr;
+	}
+	// create a new block and return it
+	return create_new_block(arena, size);
+}
+
+void *heap_malloc(struct arena *arena, size_t size)
+{
+	void *ptr;
+
+	// small objects come from slab runs, which do not need a header
+	if (size <= SLAB_MAX_SIZE) {
+		ptr = slab_alloc(arena, size);
+		if (ptr)
+			return ptr;
+	}
+
+	return block_malloc(arena, size);
+}
+
+// allocates a block big enough to hold an aligned payload after a free
+// block, then gives the slack before and after the payload back to the
+// heap, the same way try_split() does
+static void *heap_memalign(struct arena *arena, size_t alignment, size_t size)
+{
+	struct block *block, *aligned_block;
+	uintptr_t ptr, aligned;
+
+	ptr = (uintptr_t)block_malloc(arena, size + alignment + META_SIZE + MIN_SIZE);
+	block = payload_block((void *)ptr);
+
+	aligned = (ptr + alignment - 1) & ~(alignment - 1);
+	if (aligned != ptr) {
+		// the leading slack has to hold a block of its own
+		aligned = (ptr + META_SIZE + MIN_SIZE + alignment - 1) & ~(alignment - 1);
+		split_block(arena, block, aligned - META_SIZE - ptr);
+
+		aligned_block = payload_block((void *)aligned);
+		unindex_block(arena, aligned_block);
+		set_alloc(arena, aligned_block);
+		heap_free(arena, (void *)ptr);
+		block = aligned_block;
+	}
+
+	split_block(arena, block, size);
+	return (void *)aligned;
+}
+
+// carves n blocks of size bytes out of a single block, so that the free
+// index is searched once; the last one is split like in try_split()
+static void heap_malloc_batch(struct arena *arena, size_t size, size_t n, void **out)
+{
+	struct block *block, *next;
+	size_t i;
+
+	out[0] = block_malloc(arena, n * (size + META_SIZE) - META_SIZE);
+	block = payload_block(out[0]);
+
+	for (i = 1; i < n; i++) {
+		next = (struct block *)((char *)out[i - 1] + size);
+		new_block(arena, next, block_size(block) - size - META_SIZE, STATUS_ALLOC);
+		if (test_flag(block, BLOCK_SEG_END)) {
+			set_flag(next, BLOCK_SEG_END);
+			clear_flag(block, BLOCK_SEG_END);
+		}
+		set_block_size(block, size);
+		arena->stats.splits++;
+
+		if (arena->last == block)
+			arena->last = next;
+
+		block = next;
+		out[i] = block_payload(block);
+	}
+
+	split_block(arena, block, size);
+}
+
+void heap_free(struct arena *arena, void *ptr)
+{
+	struct slab_run *run = slab_lookup(ptr);
+	struct block *block = payload_block(ptr);
+
+	if (run) {
+		slab_free(run, ptr);
+		return;
+	}
+
+	if (block_status(block) != STATUS_ALLOC)
+		return;
+
+	clear_flag(block, BLOCK_ZEROED | BLOCK_PURGED | BLOCK_LAZY_PURGED);
+
+	// we try to coalesce the previous, current and next block,
+	// which are found through the boundary tags and block sizes
+	struct block *prev_block = prev_free_block(block);
+	struct block *next = next_block(arena, block);
+
+	if (prev_block) {
+		unindex_block(arena, prev_block);
+		absorb_next(arena, prev_block, block);
+		block = prev_block;
+	}
+
+	if (next && block_status(next) == STATUS_FREE) {
+		unindex_block(arena, next);
+		absorb_next(arena, block, next);
+	}
+
+	set_free(arena, block);
+
+	if (block == arena->last &&
+	    block_size(block) > (size_t)__atomic_load_n(&options.trim_threshold, __ATOMIC_RELAXED))
+		heap_trim(arena, 0);
+}
+
+void heap_decay(struct arena *arena)
+{
+	struct decay *decay = &arena->decay;
+	unsigned long decay_ms, interval, steps, now;
+	size_t limit = 0;
+	int i;
+
+	if (!decay->dirty)
+		return;
+
+	decay_ms = __atomic_load_n(&options.decay_ms, __ATOMIC_RELAXED);
+	interval = decay_ms / DECAY_STEPS ? decay_ms / DECAY_STEPS : 1;
+	now = now_ms();
+	steps = (now - decay->epoch) / interval;
+	if (decay_ms && !steps)
+		return;
+
+	// move the backlog by the steps that passed, the epoch keeps the part
+	// of the current step that already passed unless the whole backlog
+	// is gone
+	if (steps >= DECAY_STEPS) {
+		steps = DECAY_STEPS;
+		decay->epoch = now;
+	} else {
+		decay->epoch += steps * interval;
+	}
+	memmove(&decay->backlog[steps], &decay->backlog[0],
+		(DECAY_STEPS - steps) * sizeof(decay->backlog[0]));
+	memset(decay->backlog, 0, steps * sizeof(decay->backlog[0]));
+
+	// the bytes freed i steps ago may stay dirty in proportion to the
+	// part of the decay time left to them
+	for (i = 0; i < DECAY_STEPS && decay_ms; i++)
+		limit += decay->backlog[i] / DECAY_STEPS * (DECAY_STEPS - i);
+
+	purge_dirty(arena, limit);
+}
+
+int heap_purge(struct arena *arena)
+{
+	return purge_dirty(arena, 0);
+}
+
+int heap_trim(struct arena *arena, size_t pad)
+{
+	struct block *last = arena->last;
+	size_t page_size = getpagesize();
+	uintptr_t start, end, keep;
+
+	if (!last || block_status(last) != STATUS_FREE || pad >= block_size(last))
+		return 0;
+
+	// the last block keeps its free list and dirty list links and ends
+	// on a page
+	start = (uintptr_t)block_payload(last);
+	end = start + block_size(last);
+	keep = start + MIN_SIZE + sizeof(struct dirty_block) + pad;
+	keep = (keep + page_size - 1) & ~(page_size - 1);
+	if (keep >= end || end - keep < page_size)
+		return 0;
+
+	// the links are read while the whole block is still there, and the
+	// block goes back as it was if the heap cannot shrink
+	unindex_block(arena, last);
+	if (arena_trim(arena, (void *)end, end - keep)) {
+		set_free(arena, last);
+		return 0;
+	}
+
+	set_block_size(last, keep - start);
+	set_free(arena, last);
+
+	return 1;
+}
+
+// requests of at least this size are served by mmap()
+static size_t mmap_threshold(void)
+{
+	return __atomic_load_n(&options.mmap_threshold, __ATOMIC_RELAXED);
+}
+
+// a mapped block that gets freed is a size the program keeps using, so
+// later requests of that size move to the heap, where they are reused;
+// the trim threshold follows so that the heap does not shrink under them
+static void update_mmap_threshold(size_t size)
+{
+	size_t max = __atomic_load_n(&options.mmap_threshold_max, __ATOMIC_RELAXED);
+
+	if (__atomic_load_n(&options.mmap_threshold_fixed, __ATOMIC_RELAXED))
+		return;
+
+	if (size > mmap_threshold() && size <= max) {
+		__atomic_store_n(&options.mmap_threshold, size, __ATOMIC_RELAXED);
+		__atomic_store_n(&options.trim_threshold, 2 * size, __ATOMIC_RELAXED);
+	}
+}
+
+// alignment chosen at runtime, if it is above the one of the build
+static size_t runtime_alignment(void)
 {
+	long alignment = __atomic_load_n(&options.alignment, __ATOMIC_RELAXED);
+
+	return alignment > ALIGNMENT ? alignment : 0;
+}
+
+// allocates an aligned size from the heap or with mmap
+static void *malloc_aligned_size(size_t size)
+{
+	struct arena *arena;
+	void *ptr;
+
+	// size is >= the mmap threshold, so creates a block using mmap
+	if (size >= mmap_threshold())
+		return request_mmap(size);
+
+	// the common sizes are served by the cache of the thread, without locking
+	ptr = cache_alloc(size);
+	if (ptr)
+		return ptr;
+
+	arena = arena_get();
+	ptr = heap_malloc(arena, size);
+	arena_unlock(arena);
+
+	return ptr;
+}
+
+void *internal_malloc(size_t size)
+{
+	size_t alignment = runtime_alignment();
+
 	if (size <= 0)
 		return NULL;
 
+	// the headers are laid out for the alignment of the build, a bigger
+	// one needs the slack of os_memalign()
+	if (alignment)
+		return internal_memalign(alignment, size);
+
 	// align the size wanted
-	size = (size + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1);
+	return malloc_aligned_size(align_size(size));
+}
 
-	if (size < MMAP_THRESHOLD) {
-		// if the global base is NULL, we have to make the preallocation
-		if (!global_base)
-			return preallocate(size);
-		// we try to find the best free block
-		struct block_meta *best_fit_block = find_best_block(size);
+void *os_malloc(size_t size)
+{
+	void *ptr;
+
+	if (size <= 0)
+		return NULL;
 
-		// if we find a free block, we try to split it
-		if (best_fit_block)
-			return try_split(best_fit_block, size);
+	ptr = internal_malloc(size);
+	hist_alloc(ptr, size);
 
-		// if the last block is free, we expand it
-		if (last->status == 0 && last->size < size)
-			return expand_last(size);
-		// create a new block and return it
-		return create_new_block(size);
+	return ptr;
+}
+
+void internal_free(void *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	struct slab_run *run = slab_lookup(ptr);
+	struct block *block = payload_block(ptr);
+
+	// the size of an object we own does not change under us, so it
+	// can be read without locking its arena
+	if (run) {
+		if (cache_free(ptr, slab_size(run)))
+			return;
+	} else if (block_status(block) == STATUS_MAPPED) {
+		stat_add(&stats.mapped_blocks, -1);
+		stat_add(&stats.mapped_bytes, -(long)map_length(block));
+		update_mmap_threshold(block_size(block));
+		mmap_cache_put(map_start(block), map_length(block));
+		return;
+	} else if (block_status(block) == STATUS_ALLOC) {
+		if (cache_free(ptr, block_size(block)))
+			return;
 	}
-	// size is >= MMAP_TRESHOLD, so creates a block using mmap
-	return request_mmap(size);
+
+	arena_free(arena_of(ptr), ptr, ptr);
 }
 
 void os_free(void *ptr)
@@ -176,139 +768,317 @@ void os_free(void *ptr)
 	if (ptr == NULL)
 		return;
 
-	struct block_meta *block = (struct block_meta *)ptr - 1;
-	int error;
+	hist_free(ptr);
+	internal_free(ptr);
+}
+
+void os_free_sized(void *ptr, size_t size)
+{
+	struct slab_run *run = NULL;
+	struct block *block;
 
-	if (block->status == 0)
+	if (ptr == NULL)
 		return;
 
-	if (block->status == 1) {
-		// we try to coalesce the previous, current and next block
-		struct block_meta *prev_block = block->prev;
-		struct block_meta *next_block = block->next;
+	hist_free(ptr);
+	assert(size <= os_malloc_usable_size(ptr));
 
-		if (prev_block && prev_block->status == 0) {
-			prev_block->size += block->size + META_SIZE;
-			prev_block->next = next_block;
+	// the size is only a hint: slab objects are never bigger than
+	// SLAB_MAX_SIZE, so bigger sizes skip the lookup of their run, and
+	// whether a block is mapped is read from its header
+	if (align_size(size) <= SLAB_MAX_SIZE)
+		run = slab_lookup(ptr);
+	assert(run || !slab_lookup(ptr));
 
-			if (next_block)
-				next_block->prev = prev_block;
+	if (run) {
+		if (cache_free(ptr, slab_size(run)))
+			return;
 
-			if (last == block)
-				last = prev_block;
+		arena_free(arena_of(ptr), ptr, ptr);
+		return;
+	}
 
-			block = prev_block;
-		}
+	block = payload_block(ptr);
+	if (block_status(block) == STATUS_MAPPED) {
+		internal_free(ptr);
+		return;
+	}
 
-		if (next_block && next_block->status == 0) {
-			block->size += next_block->size + META_SIZE;
-			block->next = next_block->next;
+	assert(block_status(block) == STATUS_ALLOC);
+	if (cache_free(ptr, block_size(block)))
+		return;
+
+	arena_free(arena_of(ptr), ptr, ptr);
+}
 
-			if (next_block->next)
-				next_block->next->prev = block;
+void os_free_aligned_sized(void *ptr, size_t alignment, size_t size)
+{
+	(void)alignment;
+	assert(!ptr || !((uintptr_t)ptr & (alignment - 1)));
+
+	// the block of an aligned object is freed by its status like any other
+	os_free_sized(ptr, size);
+}
+
+size_t os_malloc_batch(size_t size, size_t n, void **out)
+{
+	size_t request = size, i = 0, k, max;
+	struct arena *arena;
+
+	if (size == 0)
+		return 0;
+
+	size = align_size(size);
+
+	// big and aligned objects are not carved from the heap
+	if (size >= mmap_threshold() || runtime_alignment()) {
+		for (; i < n; i++)
+			out[i] = internal_malloc(request);
+		hist_alloc_batch(out, n, request);
+		return n;
+	}
+
+	// small objects come from their slab runs one by one, bigger ones
+	// from blocks that stay below the mmap threshold
+	max = size <= SLAB_MAX_SIZE ? 1 : (mmap_threshold() + META_SIZE) / (size + META_SIZE);
+
+	arena = arena_get();
+	for (; i < n; i += k) {
+		k = n - i < max ? n - i : max;
+		if (k == 1)
+			out[i] = heap_malloc(arena, size);
+		else
+			heap_malloc_batch(arena, size, k, out + i);
+	}
+	arena_unlock(arena);
+	hist_alloc_batch(out, n, request);
+
+	return n;
+}
 
-			if (last == next_block)
-				last = block;
+static void sift_down(void **ptrs, size_t root, size_t n)
+{
+	size_t child;
+	void *tmp;
+
+	while ((child = 2 * root + 1) < n) {
+		if (child + 1 < n && (uintptr_t)ptrs[child] < (uintptr_t)ptrs[child + 1])
+			child++;
+		if ((uintptr_t)ptrs[root] >= (uintptr_t)ptrs[child])
+			return;
+
+		tmp = ptrs[root];
+		ptrs[root] = ptrs[child];
+		ptrs[child] = tmp;
+		root = child;
+	}
+}
+
+// heapsort, since qsort() may allocate
+static void sort_ptrs(void **ptrs, size_t n)
+{
+	size_t i;
+	void *tmp;
+
+	for (i = n / 2; i-- > 0;)
+		sift_down(ptrs, i, n);
+
+	for (i = n; i-- > 1;) {
+		tmp = ptrs[0];
+		ptrs[0] = ptrs[i];
+		ptrs[i] = tmp;
+		sift_down(ptrs, 0, i);
+	}
+}
+
+void os_free_batch(void **ptrs, size_t n)
+{
+	struct arena *arena = NULL;
+	struct block *block, *run = NULL;
+	void *remote = NULL, **tail = &remote;
+	size_t i;
+
+	// slab objects and mapped blocks have no neighbours to merge with,
+	// they are freed first, before any arena is locked
+	for (i = 0; i < n; i++) {
+		if (ptrs[i])
+			hist_free(ptrs[i]);
+		if (ptrs[i] && (slab_lookup(ptrs[i]) ||
+				block_status(payload_block(ptrs[i])) != STATUS_ALLOC)) {
+			internal_free(ptrs[i]);
+			ptrs[i] = NULL;
+		}
+	}
+
+	// in address order, the heap blocks of the arena of the thread that
+	// follow each other are merged into runs and every run is freed once;
+	// the others are linked in a list for their arenas, which a busy arena
+	// gets on its remote free stack like in os_free()
+	sort_ptrs(ptrs, n);
+	for (i = 0; i < n; i++) {
+		if (!ptrs[i])
+			continue;
+
+		if (!arena)
+			arena = arena_get();
+
+		if (arena_of(ptrs[i]) != arena) {
+			*tail = ptrs[i];
+			tail = ptrs[i];
+			continue;
+		}
+
+		block = payload_block(ptrs[i]);
+		if (run && next_block(arena, run) == block) {
+			absorb_next(arena, run, block);
+			continue;
 		}
 
-		block->status = 0;
-	} else if (block->status == 2) {
-		error = munmap(block, block->size + META_SIZE);
-		DIE(error == -1, "munmap failed!");
+		if (run)
+			heap_free(arena, block_payload(run));
+		run = block;
 	}
+
+	if (run)
+		heap_free(arena, block_payload(run));
+	if (arena)
+		arena_unlock(arena);
+
+	*tail = NULL;
+	if (remote)
+		arena_free_list(remote);
 }
 
-void *os_calloc(size_t nmemb, size_t size)
+// a zeroed block may still hold the free list links and the boundary tag
+// it had while it was free
+static void clear_metadata(struct block *block)
 {
-	if (size == 0 || nmemb == 0)
-		return NULL;
+	void *ptr = block_payload(block);
+
+	memset(ptr, 0, MIN_SIZE);
+	*((size_t *)((char *)ptr + block_size(block)) - 1) = 0;
+}
 
-	long page_size = getpagesize();
+// only the whole pages of a block purged with MADV_DONTNEED are zero
+static void clear_purged(struct block *block, size_t size)
+{
+	char *start = block_payload(block);
+	char *first, *last;
 
-	DIE(page_size == -1, "Page size error!");
+	purge_range(block, &first, &last);
+	if (first >= last || first >= start + size) {
+		memset(start, 0, size);
+		return;
+	}
+
+	memset(start, 0, first - start);
+	if (start + size > last)
+		memset(last, 0, start + size - last);
+}
+
+void *internal_calloc(size_t nmemb, size_t size)
+{
+	size_t alignment = runtime_alignment();
+	struct block *block = NULL;
+	struct arena *arena;
+	int zeroed = 0;
+
+	if (size == 0 || nmemb == 0)
+		return NULL;
 
 	// calculate the total memory size required
 	size_t total_size = nmemb * size;
 	void *ptr;
-	// align the size wanted
-	total_size = (total_size + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1);
 
-	// if our size is bigger than the page_size we use mmap to allocate and memset to set the memory to 0
-	if (total_size + META_SIZE > (unsigned int) page_size) {
-		ptr = mmap(NULL, total_size + META_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (alignment) {
+		ptr = internal_memalign(alignment, total_size);
+		if (ptr)
+			memset(ptr, 0, total_size);
+
+		return ptr;
+	}
 
-		struct block_meta *block = (struct block_meta *)ptr;
+	// align the size wanted
+	total_size = align_size(total_size);
 
-		block->size = total_size;
-		block->status = 2;
+	// sizes above a page are allocated with mmap, only a chunk reused
+	// from the cache has to be set to 0
+	if (total_size + META_SIZE > (size_t)getpagesize()) {
+		ptr = request_mmap(total_size);
+		if (!test_flag(payload_block(ptr), BLOCK_ZEROED))
+			memset(ptr, 0, total_size);
 
-		memset(ptr + META_SIZE, 0, total_size);
+		return ptr;
+	}
 
-		return (void *)(block + 1);
+	// else, we allocate from the heap, objects recycled by the cache are
+	// never known to be zero, and whether the block is zeroed or purged
+	// has to be read under the lock
+	arena = arena_get();
+	ptr = heap_malloc(arena, total_size);
+	if (ptr && !slab_lookup(ptr))
+		block = payload_block(ptr);
+
+	if (block && test_flag(block, BLOCK_ZEROED)) {
+		clear_metadata(block);
+		zeroed = 1;
+	} else if (block && test_flag(block, BLOCK_PURGED)) {
+		clear_purged(block, total_size);
+		zeroed = 1;
 	}
-	// else, we use malloc to allocate and memset to set the memory to 0
-	ptr = os_malloc(total_size);
+	arena_unlock(arena);
 
-	if (ptr != NULL)
+	if (ptr != NULL && !zeroed)
 		memset(ptr, 0, total_size);
 
 	return ptr;
 }
 
-// we coalesce the current block with the next block
-void coalesce(struct block_meta *block)
+void *os_calloc(size_t nmemb, size_t size)
 {
-	if (block->next->status == 0 && block->next != NULL) {
-		struct block_meta *next_block = block->next;
+	void *ptr;
 
-		// update the current block size
-		if (next_block->next == NULL)
-			block->size += next_block->size + META_SIZE;
-		else
-			block->size += (size_t)next_block->next - (size_t)next_block;
+	if (size == 0 || nmemb == 0)
+		return NULL;
 
-		if (next_block->next != 0)
-			next_block->next->prev = block;
-		block->next = next_block->next;
-	}
+	ptr = internal_calloc(nmemb, size);
+	hist_alloc(ptr, nmemb * size);
+
+	return ptr;
 }
 
-// if we can, we split the block, in order for it to have the size equal to the given parameter
-void *split_realloc(struct block_meta *block, void *ptr, size_t size)
+// we coalesce the current block with the next block
+void coalesce(struct arena *arena, struct block *block)
 {
-	// align the size wanted
-	size = (size + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1);
-	size_t remaining_size = block->size - size - META_SIZE;
+	struct block *next = next_block(arena, block);
 
-	if ((int)remaining_size <= 0) {
-		block->size = size;
-		return (void *)(block + 1);
+	if (next && block_status(next) == STATUS_FREE) {
+		unindex_block(arena, next);
+		absorb_next(arena, block, next);
+		set_alloc(arena, block);
 	}
+}
 
-	if (block->status == 2) {
-		void *dest = os_malloc(size);
-
-		memcpy(dest, ptr, size);
-		os_free(ptr);
-
-		return (void *)dest;
-	} else if (block->status == 1) {
-		struct block_meta *remaining_block = (struct block_meta *)((char *)block + size + META_SIZE);
+// resizes a heap block in place if possible, with the arena locked,
+// returns NULL if the block has to move
+static void *realloc_in_place(struct arena *arena, struct block *block, void *ptr, size_t size)
+{
+	// align the size wanted
+	size = align_size(size);
 
-		remaining_block->size = remaining_size;
-		remaining_block->status = 0;
-		remaining_block->next = block->next;
+	// we try to absorb the next block and split the result
+	if (size > block_size(block))
+		coalesce(arena, block);
 
-		if (block->next != NULL)
-			block->next->prev = remaining_block;
+	if (block_size(block) >= size) {
+		split_block(arena, block, size);
+		return ptr;
+	}
 
-		remaining_block->prev = block;
-		block->next = remaining_block;
-		block->size = size;
-		block->status = 1;
+	// if the block is the last one, we expand it
+	if (block == arena->last)
+		return expand_last(arena, size);
 
-		return (void *)(block + 1);
-	}
 	return NULL;
 }
 
@@ -324,45 +1094,132 @@ void *os_realloc(void *ptr, size_t size)
 		return NULL;
 	}
 
-	struct block_meta *block = (struct block_meta *)ptr - 1;
+	// a moved object is recorded as resized only, its birth follows it
+	hist_realloc(ptr, size);
+
+	struct slab_run *run = slab_lookup(ptr);
+	struct block *block = payload_block(ptr);
+	struct arena *arena;
+	size_t old_size;
 	void *dest;
 
-	if (block->status == 0)
+	if (run) {
+		// slab objects only stay in place while the new size fits their class
+		old_size = slab_size(run);
+		if (align_size(size) <= old_size)
+			return ptr;
+	} else if (block_status(block) == STATUS_FREE) {
 		return NULL;
+	} else if (block_status(block) == STATUS_MAPPED) {
+		// mapped blocks are never expanded in place, and only shrink in
+		// place if the rest could not hold another block
+		old_size = block_size(block);
+		if (size <= old_size && old_size - align_size(size) < META_SIZE + MIN_SIZE)
+			return ptr;
+	} else {
+		old_size = block_size(block);
+
+		arena = arena_of(ptr);
+		arena_lock(arena);
+		dest = realloc_in_place(arena, block, ptr, size);
+		arena_unlock(arena);
+
+		if (dest)
+			return dest;
+	}
+	// we allocate memory using malloc and move it using memcpy
+	dest = internal_malloc(size);
+	memcpy(dest, ptr, old_size < size ? old_size : size);
+	hist_move(ptr, dest);
+	internal_free(ptr);
 
-	if (size == block->size)
-		return ptr;
+	return dest;
+}
 
+void *internal_memalign(size_t alignment, size_t size)
+{
+	struct arena *arena;
+	size_t aligned_size;
+	void *ptr;
 
-	if (size < block->size) {
-		return split_realloc(block, ptr, size);
-	} else if (size > block->size) {
-		// align the size wanted
-		size = (size + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1);
+	if (size == 0)
+		return NULL;
 
-		// if the block is the last one, we expand it
-		if (block->next == NULL) {
-			last = block;
-			return expand_last(size);
-		}
+	if (alignment < runtime_alignment())
+		alignment = runtime_alignment();
 
-		size_t real_size = (size_t)block->next - (size_t)block - META_SIZE;
+	if (alignment <= ALIGNMENT)
+		return internal_malloc(size);
 
-		coalesce(block);
-		if (block->size == size) {
-			block->size = size;
-			return (void *)(block + 1);
-		}
-		// we try to split the block
-		if (real_size >= size)
-			return split_realloc(block, ptr, size);
-		if (block->size > size)
-			return split_realloc(block, ptr, size);
+	if (alignment > SIZE_MAX / 4 || size > SIZE_MAX / 4)
+		return NULL;
+
+	// like glibc, round the alignment up to a power of two
+	if (alignment & (alignment - 1))
+		alignment = 1UL << (64 - __builtin_clzl(alignment));
+
+	aligned_size = align_size(size);
+	if (aligned_size + alignment + META_SIZE + MIN_SIZE >= mmap_threshold()) {
+		ptr = request_mmap_aligned(alignment, aligned_size);
+	} else {
+		arena = arena_get();
+		ptr = heap_memalign(arena, alignment, aligned_size);
+		arena_unlock(arena);
 	}
-	// we allocate memory using malloc and move it using memcpy
-	dest = os_malloc(size);
-	memcpy(dest, ptr, block->size);
-	os_free(ptr);
 
-	return (void *)dest;
+	return ptr;
+}
+
+void *os_memalign(size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (size == 0)
+		return NULL;
+
+	ptr = internal_memalign(alignment, size);
+	hist_alloc(ptr, size);
+
+	return ptr;
+}
+
+int os_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (alignment < sizeof(void *) || (alignment & (alignment - 1)))
+		return EINVAL;
+
+	ptr = os_memalign(alignment, size);
+	if (!ptr && size)
+		return ENOMEM;
+
+	*memptr = ptr;
+	return 0;
+}
+
+void *os_aligned_alloc(size_t alignment, size_t size)
+{
+	if (!alignment || (alignment & (alignment - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return os_memalign(alignment, size);
+}
+
+size_t os_malloc_usable_size(void *ptr)
+{
+	struct slab_run *run;
+
+	if (ptr == NULL)
+		return 0;
+
+	// like in os_free(), the size of an object we own can be read without
+	// locking its arena
+	run = slab_lookup(ptr);
+	if (run)
+		return slab_size(run);
+
+	return block_size(payload_block(ptr));
 }
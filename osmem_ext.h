@@ -0,0 +1,148 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+#include <stddef.h>
+
+// parameters of os_mallopt(), every one of them can also be set at startup
+// through the environment variable of the same name
+
+// bytes of freed mmap() chunks kept for reuse, 0 disables the cache
+#define OSMEM_MMAP_CACHE_MAX 1
+// milliseconds after which a cached chunk is unmapped
+#define OSMEM_MMAP_CACHE_AGE_MS 2
+// requests of at least this many bytes are served by mmap(), setting it
+// turns off the dynamic threshold
+#define OSMEM_MMAP_THRESHOLD 3
+// the dynamic threshold never goes above this many bytes
+#define OSMEM_MMAP_THRESHOLD_MAX 4
+// a free block at the top of a heap that grows past this many bytes is
+// given back to the system, setting it turns off the dynamic threshold
+#define OSMEM_TRIM_THRESHOLD 5
+// 1 gives the pages of free blocks back with MADV_FREE, which is cheaper,
+// 0 with MADV_DONTNEED, which lowers the RSS right away and lets calloc()
+// skip zeroing them
+#define OSMEM_PURGE_LAZY 6
+// milliseconds over which the pages of free blocks are purged, the longer
+// they stay free the fewer are kept; 0 purges them as soon as they are freed
+#define OSMEM_DECAY_MS 7
+// 1 purges from a background thread, 0 while the arenas are used
+#define OSMEM_BACKGROUND_PURGE 8
+// 1 backs the heaps and the big mapped chunks with transparent huge pages
+#define OSMEM_THP 9
+// payloads are aligned to at least this many bytes, 8, 16, 32 or 64; values
+// above the alignment of the build go through os_memalign() and cost more
+#define OSMEM_ALIGNMENT 10
+
+// state of the allocator, as returned by os_mallinfo()
+struct os_mallinfo {
+	// current mmap threshold, in bytes
+	size_t mmap_threshold;
+	// bytes of the heaps, headers included
+	size_t heap_bytes;
+	// payload bytes and number of the allocated and free heap blocks,
+	// slab runs and cached objects count as allocated
+	size_t allocated_bytes;
+	size_t allocated_blocks;
+	size_t free_bytes;
+	size_t free_blocks;
+	// bytes and number of the mapped blocks in use
+	size_t mapped_bytes;
+	size_t mapped_blocks;
+	// most bytes ever mapped at once for the heaps, the mapped blocks and
+	// the chunks kept by the mmap cache
+	size_t peak_bytes;
+	// syscalls made since the start
+	size_t sbrk_calls;
+	size_t mmap_calls;
+	size_t munmap_calls;
+	// heap blocks split and merged since the start
+	size_t splits;
+	size_t coalesces;
+};
+
+// set an allocator parameter, returns 1 on success and 0 on error
+int os_mallopt(int param, long value);
+
+// allocate size bytes aligned to alignment, which is rounded up to a power
+// of two
+void *os_memalign(size_t alignment, size_t size);
+
+// allocate size bytes aligned to alignment in *memptr, alignment must be a
+// power of two multiple of sizeof(void *); returns 0, EINVAL or ENOMEM
+int os_posix_memalign(void **memptr, size_t alignment, size_t size);
+
+// allocate size bytes aligned to alignment, which must be a power of two
+void *os_aligned_alloc(size_t alignment, size_t size);
+
+// free ptr, allocated with size bytes, or with any size up to
+// os_malloc_usable_size(ptr); the size is a hint, sizes above the slab
+// classes skip the lookup of a slab run
+void os_free_sized(void *ptr, size_t size);
+
+// free ptr, allocated with size bytes aligned to alignment
+void os_free_aligned_sized(void *ptr, size_t alignment, size_t size);
+
+// allocate n objects of size bytes in out, carved from as few heap blocks
+// as possible; returns the number of objects allocated
+size_t os_malloc_batch(size_t size, size_t n, void **out);
+
+// free the n objects in ptrs, which may hold NULLs; ptrs is used as
+// scratch space, its entries are reordered and some are set to NULL;
+// objects that follow each other on a heap are coalesced once
+void os_free_batch(void **ptrs, size_t n);
+
+// a region hands out objects from chunks with a bump pointer, and frees all
+// of them at once; it is not thread-safe
+struct os_region;
+
+// create an empty region, or return NULL
+struct os_region *os_region_create(void);
+
+// allocate size bytes from the region, or return NULL
+void *os_region_alloc(struct os_region *region, size_t size);
+
+// free every object of the region at once, its chunks are kept for reuse
+void os_region_reset(struct os_region *region);
+
+// free every object of the region and the region itself
+void os_region_destroy(struct os_region *region);
+
+// a pool hands out objects of a single size from an intrusive free list,
+// through a magazine of objects in every thread for the first 16 pools
+struct os_pool;
+
+// create a pool of objects of obj_size bytes aligned to align, a power of
+// two or 0 for pointer alignment; returns NULL on error
+struct os_pool *os_pool_create(size_t obj_size, size_t align);
+
+// take an object from the pool, or return NULL
+void *os_pool_get(struct os_pool *pool);
+
+// give an object back to its pool
+void os_pool_put(struct os_pool *pool, void *ptr);
+
+// free the pool and all its objects, no thread may use it any more
+void os_pool_destroy(struct os_pool *pool);
+
+// return the number of bytes that can be used at ptr, at least the size
+// it was allocated with; 0 for NULL
+size_t os_malloc_usable_size(void *ptr);
+
+// return the current state of the allocator
+struct os_mallinfo os_mallinfo(void);
+
+// print the state of the allocator
+void os_malloc_stats(void);
+
+// write the histograms of the sizes asked for, of the new sizes of
+// os_realloc() in percent of the usable ones and of the lifetimes of one
+// object in lifetime_sample, counted in allocations, to fd as JSON; every
+// histogram is a list of [min, max, count] buckets; returns 0, or -1 on
+// error or if the build has no HISTOGRAM=1
+int os_histogram_dump(int fd);
+
+// give the free memory at the top of every heap back to the system, except
+// for pad bytes, and unmap the cached chunks; returns 1 if any memory was
+// released
+int os_trim(size_t pad);
@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include "block_meta.h"
+#include "pagemap.h"
+#include "stats.h"
+
+// two-level radix tree over the 48-bit user address space
+#define ADDRESS_BITS 48
+#define LEAF_BITS 18
+#define ROOT_BITS (ADDRESS_BITS - PAGEMAP_SHIFT - LEAF_BITS)
+
+#define LEAF_SIZE ((1UL << LEAF_BITS) * sizeof(void *))
+
+// leaves are mapped on first use, only the touched pages become resident;
+// arenas set entries under their own locks, so two of them may race to add
+// a leaf, and lookups run without any lock
+static void **root[1UL << ROOT_BITS];
+
+void pagemap_set(void *addr, void *value)
+{
+	uintptr_t page = (uintptr_t)addr >> PAGEMAP_SHIFT;
+	void **leaf = __atomic_load_n(&root[page >> LEAF_BITS], __ATOMIC_ACQUIRE);
+	void **new_leaf;
+	int error;
+
+	if (!leaf) {
+		if (!value)
+			return;
+
+		new_leaf = mmap(NULL, LEAF_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		DIE(new_leaf == MAP_FAILED, "mmap failed");
+		stat_add(&stats.mmap_calls, 1);
+
+		// the loser of a race drops its leaf and writes into the winner's
+		if (__atomic_compare_exchange_n(&root[page >> LEAF_BITS], &leaf, new_leaf, 0,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			leaf = new_leaf;
+		} else {
+			error = munmap(new_leaf, LEAF_SIZE);
+			DIE(error == -1, "munmap failed!");
+			stat_add(&stats.munmap_calls, 1);
+		}
+	}
+
+	__atomic_store_n(&leaf[page & ((1UL << LEAF_BITS) - 1)], value, __ATOMIC_RELEASE);
+}
+
+void *pagemap_get(void *addr)
+{
+	uintptr_t page = (uintptr_t)addr >> PAGEMAP_SHIFT;
+	void **leaf;
+
+	if ((uintptr_t)addr >> ADDRESS_BITS)
+		return NULL;
+
+	leaf = __atomic_load_n(&root[page >> LEAF_BITS], __ATOMIC_ACQUIRE);
+	return leaf ? __atomic_load_n(&leaf[page & ((1UL << LEAF_BITS) - 1)], __ATOMIC_ACQUIRE) : NULL;
+}
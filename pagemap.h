@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+// pages tracked by the page map
+#define PAGEMAP_SHIFT 12
+#define PAGEMAP_PAGE (1UL << PAGEMAP_SHIFT)
+
+// associate value with the page holding addr, NULL clears the entry
+void pagemap_set(void *addr, void *value);
+
+// return the value associated with the page holding addr, or NULL
+void *pagemap_get(void *addr);
@@ -0,0 +1,278 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/rseq.h>
+#include "block_meta.h"
+#include "cache.h"
+#include "heap.h"
+#include "stats.h"
+
+// objects up to PERCPU_MAX_SIZE bytes are cached, one bin per ALIGNMENT step
+#define PERCPU_MAX_SIZE 512
+#define PERCPU_BINS (PERCPU_MAX_SIZE / ALIGNMENT)
+
+// objects kept in a bin of one CPU, refills and flushes move half of them
+#define PERCPU_SLOTS 16
+#define PERCPU_BATCH (PERCPU_SLOTS / 2)
+
+#define RSEQ_SIG 0x53053053
+
+// a bin is a stack of slots, count is the word a push or pop commits
+struct percpu_bin {
+	unsigned long count;
+	void *slots[PERCPU_SLOTS];
+};
+
+struct cpu_cache {
+	struct percpu_bin bins[PERCPU_BINS];
+} __attribute__((aligned(64)));
+
+// glibc 2.35 and later registers rseq for every thread and tells where
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+
+// the rseq area of the thread when glibc does not register one
+static __thread struct rseq rseq_area __attribute__((tls_model("initial-exec")));
+// 0 before the first use, 1 once registered, -1 if registration failed
+static __thread int rseq_state __attribute__((tls_model("initial-exec")));
+
+static struct cpu_cache *caches;
+static unsigned int nr_cpus;
+// offset of the rseq area of every thread from its thread pointer
+static ptrdiff_t rseq_offset;
+static int own_rseq;
+static pthread_once_t percpu_once = PTHREAD_ONCE_INIT;
+
+static void percpu_init(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_CONF);
+	void *map;
+
+	if (cpus < 1)
+		return;
+
+	if (&__rseq_size && __rseq_size) {
+		rseq_offset = __rseq_offset;
+	} else {
+		rseq_offset = (char *)&rseq_area - (char *)__builtin_thread_pointer();
+		own_rseq = 1;
+	}
+
+	map = mmap(NULL, cpus * sizeof(struct cpu_cache), PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return;
+	stat_add(&stats.mmap_calls, 1);
+
+	nr_cpus = cpus;
+	caches = map;
+}
+
+// the calling thread can use the caches, otherwise it takes the arena locks
+static int percpu_ready(void)
+{
+	if (rseq_state)
+		return rseq_state > 0;
+
+	pthread_once(&percpu_once, percpu_init);
+	if (!caches)
+		rseq_state = -1;
+	else if (!own_rseq)
+		rseq_state = 1;
+	else
+		rseq_state = syscall(__NR_rseq, &rseq_area, sizeof(rseq_area), 0, RSEQ_SIG) ? -1 : 1;
+
+	return rseq_state > 0;
+}
+
+#if defined(__x86_64__)
+
+// the CPU the thread runs on, as the kernel tells it through rseq
+static unsigned int rseq_cpu(void)
+{
+	unsigned int cpu;
+
+	asm volatile("movl %%fs:4(%1), %0" : "=r"(cpu) : "r"(rseq_offset));
+	return cpu;
+}
+
+// every push and pop is a restartable sequence: the kernel moves the thread
+// back to its start if it is preempted or migrated before the commit, so
+// the bins of a CPU are changed without atomics; 3 is the descriptor of the
+// sequence running from 1 to 2, and 4 the abort handler behind the
+// signature the kernel checks
+#define RSEQ_START							\
+	".pushsection __rseq_cs, \"aw\"\n\t"				\
+	".balign 32\n\t"						\
+	"3:\n\t"							\
+	".long 0, 0\n\t"						\
+	".quad 1f, 2f - 1f, 4f\n\t"					\
+	".popsection\n\t"						\
+	"6:\n\t"							\
+	"leaq 3b(%%rip), %%rax\n\t"					\
+	"movq %%rax, %%fs:8(%[off])\n\t"				\
+	"1:\n\t"
+
+#define RSEQ_END							\
+	"2:\n\t"							\
+	".pushsection __rseq_failure, \"ax\"\n\t"			\
+	".byte 0x0f, 0xb9, 0x3d\n\t"					\
+	".long %c[sig]\n\t"						\
+	"4:\n\t"							\
+	"jmp 6b\n\t"							\
+	".popsection\n\t"
+
+// rcx = the bin of the current CPU, or leave with rax = 0 if the CPU
+// number is not valid
+#define RSEQ_BIN							\
+	"movl %%fs:4(%[off]), %%ecx\n\t"				\
+	"xorl %%eax, %%eax\n\t"						\
+	"cmpl %[cpus], %%ecx\n\t"					\
+	"jae 2f\n\t"							\
+	"imulq %[stride], %%rcx\n\t"					\
+	"addq %[bin], %%rcx\n\t"
+
+// pops an object from a bin of the current CPU, NULL if it is empty
+static void *percpu_pop(size_t bin)
+{
+	void *ptr;
+
+	asm volatile(RSEQ_START
+		     RSEQ_BIN
+		     "movq (%%rcx), %%rdx\n\t"
+		     "testq %%rdx, %%rdx\n\t"
+		     "jz 2f\n\t"
+		     "movq (%%rcx, %%rdx, 8), %%rax\n\t"
+		     "decq %%rdx\n\t"
+		     "movq %%rdx, (%%rcx)\n\t"
+		     RSEQ_END
+		     : "=&a"(ptr)
+		     : [off] "r"(rseq_offset), [cpus] "r"(nr_cpus),
+		       [stride] "r"(sizeof(struct cpu_cache)),
+		       [bin] "r"(&caches->bins[bin]), [sig] "i"(RSEQ_SIG)
+		     : "rcx", "rdx", "memory", "cc");
+
+	return ptr;
+}
+
+// pushes an object on a bin of the current CPU, returns 0 if it is full
+static int percpu_push(size_t bin, void *ptr)
+{
+	int ret;
+
+	asm volatile(RSEQ_START
+		     RSEQ_BIN
+		     "movq (%%rcx), %%rdx\n\t"
+		     "cmpq %[slots], %%rdx\n\t"
+		     "jae 2f\n\t"
+		     "movq %[ptr], 8(%%rcx, %%rdx, 8)\n\t"
+		     "incq %%rdx\n\t"
+		     "movl $1, %%eax\n\t"
+		     "movq %%rdx, (%%rcx)\n\t"
+		     RSEQ_END
+		     : "=&a"(ret)
+		     : [off] "r"(rseq_offset), [cpus] "r"(nr_cpus),
+		       [stride] "r"(sizeof(struct cpu_cache)),
+		       [bin] "r"(&caches->bins[bin]), [ptr] "r"(ptr),
+		       [slots] "i"(PERCPU_SLOTS), [sig] "i"(RSEQ_SIG)
+		     : "rcx", "rdx", "memory", "cc");
+
+	return ret;
+}
+
+#else
+
+// without a restartable sequence for this architecture every request
+// takes the arena locks
+static unsigned int rseq_cpu(void)
+{
+	return ~0U;
+}
+
+static void *percpu_pop(size_t bin)
+{
+	(void)bin;
+	return NULL;
+}
+
+static int percpu_push(size_t bin, void *ptr)
+{
+	(void)bin;
+	(void)ptr;
+	return 0;
+}
+
+#endif
+
+// map an object size to its bin, or return -1 if it is not cached
+static int percpu_bin(size_t size)
+{
+	if (size > PERCPU_MAX_SIZE || !percpu_ready())
+		return -1;
+
+	return size / ALIGNMENT - 1;
+}
+
+void *cache_alloc(size_t size)
+{
+	struct arena *arena;
+	void *batch[PERCPU_BATCH];
+	void *ptr;
+	int bin, i, n;
+
+	// slab_alloc() rounds small sizes up to their class
+	if (size <= SLAB_MAX_SIZE)
+		size = slab_class_size(size);
+
+	bin = percpu_bin(size);
+	if (bin < 0)
+		return NULL;
+
+	ptr = percpu_pop(bin);
+	if (ptr || rseq_cpu() >= nr_cpus)
+		return ptr;
+
+	arena = arena_get();
+	for (n = 0; n < PERCPU_BATCH; n++) {
+		batch[n] = heap_malloc(arena, size);
+		if (!batch[n])
+			break;
+	}
+	arena_unlock(arena);
+
+	// the thread may have moved to another CPU, whose bin is full
+	for (i = 1; i < n; i++)
+		if (!percpu_push(bin, batch[i]))
+			arena_free(arena, batch[i], batch[i]);
+
+	return n ? batch[0] : NULL;
+}
+
+int cache_free(void *ptr, size_t size)
+{
+	void *list = NULL;
+	void *obj;
+	int bin = percpu_bin(size);
+	int i;
+
+	if (bin < 0)
+		return 0;
+
+	if (percpu_push(bin, ptr))
+		return 1;
+
+	// the bin is full, half of it goes back to the arenas
+	for (i = 0; i < PERCPU_BATCH; i++) {
+		obj = percpu_pop(bin);
+		if (!obj)
+			break;
+		*(void **)obj = list;
+		list = obj;
+	}
+	arena_free_list(list);
+
+	return percpu_push(bin, ptr);
+}
@@ -0,0 +1,337 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+#include <stdint.h>
+#include "osmem.h"
+#include "block.h"
+#include "osmem_ext.h"
+#include "pool.h"
+#include "histogram.h"
+
+// pools get chunks of at least POOL_CHUNK_SIZE bytes and carve their
+// objects on demand
+#define POOL_CHUNK_SIZE (64 * 1024)
+
+// the first POOL_MAX pools alive get a magazine in every thread, refills
+// and flushes move MAGAZINE_BATCH objects at once
+#define POOL_MAX 16
+#define MAGAZINE_SIZE 32
+#define MAGAZINE_BATCH (MAGAZINE_SIZE / 2)
+
+// free objects are linked through their first word
+struct pool_object {
+	struct pool_object *next;
+};
+
+struct pool_chunk {
+	struct pool_chunk *next;
+};
+
+struct os_pool {
+	// size of an object slot and its alignment
+	size_t size;
+	size_t align;
+	// index of the magazines of the pool, -1 if it has none
+	int id;
+	// unique for every pool created, a magazine belongs to the pool with
+	// the same generation
+	unsigned long gen;
+	// next pool alive, linked under the pools lock
+	struct os_pool *next;
+	pthread_mutex_t lock;
+	struct pool_object *free;
+	struct pool_chunk *chunks;
+	// part of the newest chunk not carved yet
+	char *ptr;
+	char *end;
+};
+
+struct magazine {
+	struct pool_object *head;
+	unsigned long count;
+	unsigned long gen;
+};
+
+struct magazines {
+	struct magazine mags[POOL_MAX];
+	// 0 before the first use, 1 while in use, -1 once the thread exits
+	int state;
+};
+
+static __thread struct magazines magazines __attribute__((tls_model("initial-exec")));
+
+static struct os_pool *pools[POOL_MAX];
+static struct os_pool *all_pools;
+static unsigned long next_gen = 1;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t magazines_key;
+static pthread_once_t magazines_once = PTHREAD_ONCE_INIT;
+
+// pushes n objects from first to last on the free list of the pool
+static void pool_push(struct os_pool *pool, struct pool_object *first,
+		      struct pool_object *last)
+{
+	pthread_mutex_lock(&pool->lock);
+	last->next = pool->free;
+	pool->free = first;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// the thread exits, the objects of its magazines go back to their pools
+static void magazines_destroy(void *arg)
+{
+	struct magazine *mag;
+	struct pool_object *last;
+	int i;
+
+	(void)arg;
+	pthread_mutex_lock(&pools_lock);
+	for (i = 0; i < POOL_MAX; i++) {
+		mag = &magazines.mags[i];
+		if (mag->head && pools[i] && pools[i]->gen == mag->gen) {
+			for (last = mag->head; last->next; last = last->next)
+				;
+			pool_push(pools[i], mag->head, last);
+		}
+		mag->head = NULL;
+		mag->count = 0;
+	}
+	pthread_mutex_unlock(&pools_lock);
+
+	// pools used by later destructors take their locks
+	magazines.state = -1;
+}
+
+static void magazines_key_create(void)
+{
+	pthread_key_create(&magazines_key, magazines_destroy);
+}
+
+// a magazine left by a destroyed pool with the same index held freed
+// memory, it starts again empty; the key destructor flushes the magazines
+// when the thread exits
+static void magazine_init(struct os_pool *pool, struct magazine *mag)
+{
+	if (!magazines.state) {
+		pthread_once(&magazines_once, magazines_key_create);
+		pthread_setspecific(magazines_key, &magazines);
+		magazines.state = 1;
+	}
+
+	mag->head = NULL;
+	mag->count = 0;
+	mag->gen = pool->gen;
+}
+
+// the magazine of the pool in the calling thread, or NULL if it has none
+static struct magazine *pool_magazine(struct os_pool *pool)
+{
+	struct magazine *mag;
+
+	if (pool->id < 0 || magazines.state < 0)
+		return NULL;
+
+	mag = &magazines.mags[pool->id];
+	if (mag->gen != pool->gen)
+		magazine_init(pool, mag);
+
+	return mag;
+}
+
+struct os_pool *os_pool_create(size_t obj_size, size_t align)
+{
+	struct os_pool *pool;
+	int i;
+
+	if (obj_size == 0 || obj_size > SIZE_MAX / 4 || (align & (align - 1)) ||
+	    align > POOL_CHUNK_SIZE)
+		return NULL;
+
+	// free objects have to hold a pointer
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	if (obj_size < sizeof(void *))
+		obj_size = sizeof(void *);
+
+	pool = internal_calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->size = (obj_size + align - 1) & ~(align - 1);
+	pool->align = align;
+	pool->id = -1;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	pthread_mutex_lock(&pools_lock);
+	pool->gen = next_gen++;
+	pool->next = all_pools;
+	all_pools = pool;
+	for (i = 0; i < POOL_MAX; i++) {
+		if (!pools[i]) {
+			pools[i] = pool;
+			pool->id = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pools_lock);
+
+	return pool;
+}
+
+// carves an object from the newest chunk, with the pool locked
+static struct pool_object *pool_carve(struct os_pool *pool)
+{
+	size_t header = (sizeof(struct pool_chunk) + pool->align - 1) & ~(pool->align - 1);
+	size_t len = header + pool->size;
+	struct pool_chunk *chunk;
+	void *obj;
+
+	if ((size_t)(pool->end - pool->ptr) < pool->size) {
+		if (len < POOL_CHUNK_SIZE)
+			len = POOL_CHUNK_SIZE;
+
+		chunk = internal_memalign(pool->align, len);
+		if (!chunk)
+			return NULL;
+
+		chunk->next = pool->chunks;
+		pool->chunks = chunk;
+		pool->ptr = (char *)chunk + header;
+		pool->end = (char *)chunk + len;
+	}
+
+	obj = pool->ptr;
+	pool->ptr += pool->size;
+
+	return obj;
+}
+
+// takes one object, or n for the magazine, with the pool locked
+static struct pool_object *pool_take(struct os_pool *pool, struct magazine *mag)
+{
+	struct pool_object *obj;
+	unsigned int n = mag ? MAGAZINE_BATCH : 1;
+
+	for (; n; n--) {
+		obj = pool->free;
+		if (obj)
+			pool->free = obj->next;
+		else
+			obj = pool_carve(pool);
+
+		if (!obj || !mag)
+			break;
+
+		obj->next = mag->head;
+		mag->head = obj;
+		mag->count++;
+	}
+
+	if (!mag)
+		return obj;
+
+	obj = mag->head;
+	if (obj) {
+		mag->head = obj->next;
+		mag->count--;
+	}
+
+	return obj;
+}
+
+void *os_pool_get(struct os_pool *pool)
+{
+	struct magazine *mag = pool_magazine(pool);
+	struct pool_object *obj;
+
+	if (mag && mag->head) {
+		obj = mag->head;
+		mag->head = obj->next;
+		mag->count--;
+		return obj;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	obj = pool_take(pool, mag);
+	pthread_mutex_unlock(&pool->lock);
+
+	return obj;
+}
+
+void os_pool_put(struct os_pool *pool, void *ptr)
+{
+	struct magazine *mag = pool_magazine(pool);
+	struct pool_object *obj = ptr, *last;
+	int i;
+
+	if (!ptr)
+		return;
+
+	if (!mag) {
+		obj->next = NULL;
+		pool_push(pool, obj, obj);
+		return;
+	}
+
+	obj->next = mag->head;
+	mag->head = obj;
+	if (++mag->count <= MAGAZINE_SIZE)
+		return;
+
+	// the magazine is full, the oldest half goes back to the pool
+	for (last = obj, i = 1; i < MAGAZINE_BATCH; i++)
+		last = last->next;
+
+	obj = last->next;
+	last->next = NULL;
+	mag->count = MAGAZINE_BATCH;
+
+	for (last = obj; last->next; last = last->next)
+		;
+	pool_push(pool, obj, last);
+}
+
+void os_pool_destroy(struct os_pool *pool)
+{
+	struct pool_chunk *chunk, *next;
+	struct os_pool **link;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pools_lock);
+	if (pool->id >= 0)
+		pools[pool->id] = NULL;
+	for (link = &all_pools; *link != pool; link = &(*link)->next)
+		;
+	*link = pool->next;
+	pthread_mutex_unlock(&pools_lock);
+
+	for (chunk = pool->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		internal_free(chunk);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	internal_free(pool);
+}
+
+// the pools lock comes before the lock of a pool, which comes before the
+// arenas when a pool grows
+void pool_lock_all(void)
+{
+	struct os_pool *pool;
+
+	pthread_mutex_lock(&pools_lock);
+	for (pool = all_pools; pool; pool = pool->next)
+		pthread_mutex_lock(&pool->lock);
+}
+
+void pool_unlock_all(void)
+{
+	struct os_pool *pool;
+
+	for (pool = all_pools; pool; pool = pool->next)
+		pthread_mutex_unlock(&pool->lock);
+	pthread_mutex_unlock(&pools_lock);
+}
@@ -0,0 +1,8 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+// take and release the locks of every pool around fork(), so that the child
+// does not inherit them held by threads it does not have
+void pool_lock_all(void);
+void pool_unlock_all(void);
@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdint.h>
+#include "osmem.h"
+#include "block.h"
+#include "osmem_ext.h"
+#include "histogram.h"
+
+// regions grow by chunks of REGION_CHUNK_SIZE bytes, which stay below the
+// mmap threshold so that they come from the heap; bigger objects get a
+// chunk of their own
+#define REGION_CHUNK_SIZE (64 * 1024)
+
+// a chunk is allocated with internal_malloc(), its objects follow its header
+struct region_chunk {
+	struct region_chunk *next;
+	// bytes for objects after the header
+	size_t size;
+} __attribute__((aligned(ALIGNMENT)));
+
+struct os_region {
+	// chunks in use, the current one first, and the last one so that a
+	// reset moves all of them at once
+	struct region_chunk *chunks;
+	struct region_chunk *last;
+	// chunks kept by the resets
+	struct region_chunk *free;
+	// free part of the current chunk
+	char *ptr;
+	char *end;
+};
+
+struct os_region *os_region_create(void)
+{
+	return internal_calloc(1, sizeof(struct os_region));
+}
+
+// takes a chunk of at least size bytes from the ones kept by the resets,
+// or allocates one
+static struct region_chunk *get_chunk(struct os_region *region, size_t size)
+{
+	struct region_chunk **link, *chunk;
+
+	for (link = &region->free; *link; link = &(*link)->next) {
+		chunk = *link;
+		if (chunk->size >= size) {
+			*link = chunk->next;
+			return chunk;
+		}
+	}
+
+	if (size < REGION_CHUNK_SIZE - sizeof(*chunk))
+		size = REGION_CHUNK_SIZE - sizeof(*chunk);
+
+	chunk = internal_malloc(sizeof(*chunk) + size);
+	if (chunk)
+		chunk->size = size;
+
+	return chunk;
+}
+
+void *os_region_alloc(struct os_region *region, size_t size)
+{
+	struct region_chunk *chunk;
+	void *ptr;
+
+	if (size == 0 || size > SIZE_MAX / 2)
+		return NULL;
+
+	size = align_size(size);
+
+	// the rest of the current chunk is left behind
+	if ((size_t)(region->end - region->ptr) < size) {
+		chunk = get_chunk(region, size);
+		if (!chunk)
+			return NULL;
+
+		chunk->next = region->chunks;
+		region->chunks = chunk;
+		if (!region->last)
+			region->last = chunk;
+
+		region->ptr = (char *)(chunk + 1);
+		region->end = region->ptr + chunk->size;
+	}
+
+	ptr = region->ptr;
+	region->ptr += size;
+
+	return ptr;
+}
+
+void os_region_reset(struct os_region *region)
+{
+	if (!region->chunks)
+		return;
+
+	region->last->next = region->free;
+	region->free = region->chunks;
+	region->chunks = NULL;
+	region->last = NULL;
+	region->ptr = NULL;
+	region->end = NULL;
+}
+
+void os_region_destroy(struct os_region *region)
+{
+	struct region_chunk *chunk, *next;
+
+	if (!region)
+		return;
+
+	os_region_reset(region);
+	for (chunk = region->free; chunk; chunk = next) {
+		next = chunk->next;
+		internal_free(chunk);
+	}
+
+	internal_free(region);
+}
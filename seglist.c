@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "freelist.h"
+
+// map a size to the bin holding free blocks of that size
+static size_t bin_index(size_t size)
+{
+	size_t log;
+
+	if (size < SMALL_LIMIT)
+		return size / ALIGNMENT;
+
+	log = 63 - __builtin_clzl(size);
+	return NR_SMALL_BINS + (log - SMALL_SHIFT) * SUB_BINS +
+		((size >> (log - SUB_BINS_SHIFT)) & (SUB_BINS - 1));
+}
+
+// return the first non-empty bin starting with idx, or NR_BINS
+static size_t next_bin(struct freelist *list, size_t idx)
+{
+	size_t word = idx / 64;
+	uint64_t bits;
+
+	if (idx >= NR_BINS)
+		return NR_BINS;
+
+	bits = list->binmap[word] & (~0UL << (idx % 64));
+	while (!bits) {
+		if (++word == MAP_WORDS)
+			return NR_BINS;
+		bits = list->binmap[word];
+	}
+
+	return word * 64 + __builtin_ctzl(bits);
+}
+
+// search a bin for its smallest block of at least size bytes
+static struct block *best_in_bin(struct freelist *list, size_t idx, size_t size)
+{
+	struct block *best = NULL;
+	struct block *block;
+
+	// small bins only hold blocks of one size
+	if (idx < NR_SMALL_BINS)
+		return block_size(list->bins[idx]) >= size ? list->bins[idx] : NULL;
+
+	for (block = list->bins[idx]; block; block = free_next(block)) {
+		if (block_size(block) < size)
+			continue;
+		if (best && block_size(block) >= block_size(best))
+			continue;
+		best = block;
+		if (block_size(block) == size)
+			break;
+	}
+
+	return best;
+}
+
+void freelist_insert(struct freelist *list, struct block *block)
+{
+	size_t idx = bin_index(block_size(block));
+
+	set_free_prev(block, NULL);
+	set_free_next(block, list->bins[idx]);
+	if (list->bins[idx])
+		set_free_prev(list->bins[idx], block);
+	list->bins[idx] = block;
+	list->binmap[idx / 64] |= 1UL << (idx % 64);
+}
+
+void freelist_remove(struct freelist *list, struct block *block)
+{
+	size_t idx = bin_index(block_size(block));
+	struct block *prev = free_prev(block);
+	struct block *next = free_next(block);
+
+	if (prev)
+		set_free_next(prev, next);
+	else
+		list->bins[idx] = next;
+
+	if (next)
+		set_free_prev(next, prev);
+
+	if (!list->bins[idx])
+		list->binmap[idx / 64] &= ~(1UL << (idx % 64));
+}
+
+struct block *freelist_find(struct freelist *list, size_t size)
+{
+	struct block *best;
+	size_t idx;
+
+	// only the first bin may hold blocks that are too small
+	for (idx = next_bin(list, bin_index(size)); idx < NR_BINS; idx = next_bin(list, idx + 1)) {
+		best = best_in_bin(list, idx, size);
+		if (best)
+			return best;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+#include <stdint.h>
+#include "block.h"
+
+// sizes below SMALL_LIMIT get one bin per ALIGNMENT step
+#define NR_SMALL_BINS 64
+#define SMALL_LIMIT (NR_SMALL_BINS * ALIGNMENT)
+#define SMALL_SHIFT (__builtin_ctzl(SMALL_LIMIT))
+
+// bigger sizes get SUB_BINS bins for every power of two
+#define SUB_BINS_SHIFT 3
+#define SUB_BINS (1 << SUB_BINS_SHIFT)
+#define NR_LARGE_BINS ((64 - SMALL_SHIFT) * SUB_BINS)
+
+#define NR_BINS (NR_SMALL_BINS + NR_LARGE_BINS)
+#define MAP_WORDS ((NR_BINS + 63) / 64)
+
+// segregated free lists of one arena
+struct freelist {
+	struct block *bins[NR_BINS];
+	uint64_t binmap[MAP_WORDS];
+};
@@ -0,0 +1,208 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdint.h>
+#include "heap.h"
+#include "pagemap.h"
+#include "slab.h"
+
+// every run is one page of objects of a single size class
+#define RUN_SIZE PAGEMAP_PAGE
+#define RUN_MAP_WORDS (RUN_SIZE / SLAB_CLASS_SIZE / 64)
+#define RUNS_PER_CHUNK 16
+
+struct slab_run {
+	struct slab_run *prev;
+	struct slab_run *next;
+	struct slab_chunk *chunk;
+	char *objects;
+	// object size, 0 while the run is not used by any class
+	unsigned int size;
+	unsigned int nr_free;
+	uint64_t free_map[RUN_MAP_WORDS];
+};
+
+// runs are carved from chunks allocated on the heap, the run descriptors
+// sit at the start of the chunk and the runs start at the next page boundary
+struct slab_chunk {
+	struct arena *arena;
+	unsigned int nr_empty;
+	struct slab_run runs[RUNS_PER_CHUNK];
+};
+
+#define CHUNK_SIZE (sizeof(struct slab_chunk) + (RUNS_PER_CHUNK + 1) * RUN_SIZE)
+
+static void run_list_add(struct slab_run **list, struct slab_run *run)
+{
+	run->prev = NULL;
+	run->next = *list;
+	if (*list)
+		(*list)->prev = run;
+	*list = run;
+}
+
+static void run_list_del(struct slab_run **list, struct slab_run *run)
+{
+	if (run->prev)
+		run->prev->next = run->next;
+	else
+		*list = run->next;
+
+	if (run->next)
+		run->next->prev = run->prev;
+}
+
+// allocates a chunk on the heap and registers its runs in the page map
+static int create_chunk(struct arena *arena)
+{
+	struct slab_chunk *chunk = heap_malloc(arena, align_size(CHUNK_SIZE));
+	struct slab_run *run;
+	uintptr_t objects;
+	int i;
+
+	if (!chunk)
+		return -1;
+
+	objects = ((uintptr_t)(chunk + 1) + RUN_SIZE - 1) & ~(RUN_SIZE - 1);
+	chunk->arena = arena;
+	chunk->nr_empty = RUNS_PER_CHUNK;
+
+	for (i = 0; i < RUNS_PER_CHUNK; i++) {
+		run = &chunk->runs[i];
+		run->chunk = chunk;
+		run->objects = (char *)objects + i * RUN_SIZE;
+		run->size = 0;
+
+		pagemap_set(run->objects, run);
+		run_list_add(&arena->slab.empty_runs, run);
+	}
+
+	arena->slab.empty_chunks++;
+	return 0;
+}
+
+// gives a chunk with no run in use back to the heap
+static void release_chunk(struct slab_chunk *chunk)
+{
+	struct arena *arena = chunk->arena;
+	struct slab_run *run;
+	int i;
+
+	for (i = 0; i < RUNS_PER_CHUNK; i++) {
+		run = &chunk->runs[i];
+		run_list_del(&arena->slab.empty_runs, run);
+		pagemap_set(run->objects, NULL);
+	}
+
+	heap_free(arena, chunk);
+}
+
+// takes an unused run and prepares it for objects of the given size
+static struct slab_run *get_run(struct arena *arena, unsigned int size)
+{
+	struct slab_cache *slab = &arena->slab;
+	struct slab_run *run;
+	unsigned int left, i;
+
+	if (!slab->empty_runs && create_chunk(arena))
+		return NULL;
+
+	run = slab->empty_runs;
+	run_list_del(&slab->empty_runs, run);
+	if (run->chunk->nr_empty-- == RUNS_PER_CHUNK)
+		slab->empty_chunks--;
+
+	run->size = size;
+	run->nr_free = RUN_SIZE / size;
+
+	left = run->nr_free;
+	for (i = 0; i < RUN_MAP_WORDS; i++, left = left > 64 ? left - 64 : 0)
+		run->free_map[i] = left >= 64 ? ~0UL : (1UL << left) - 1;
+
+	return run;
+}
+
+// gives a run with no object in use back to its chunk
+static void put_run(struct slab_run *run)
+{
+	struct slab_chunk *chunk = run->chunk;
+	struct slab_cache *slab = &chunk->arena->slab;
+
+	run->size = 0;
+	run_list_add(&slab->empty_runs, run);
+
+	if (++chunk->nr_empty < RUNS_PER_CHUNK)
+		return;
+
+	// one empty chunk is kept, so that a burst of frees followed by
+	// allocations does not keep returning chunks to the heap
+	if (slab->empty_chunks)
+		release_chunk(chunk);
+	else
+		slab->empty_chunks++;
+}
+
+void *slab_alloc(struct arena *arena, size_t size)
+{
+	unsigned int class = (size - 1) / SLAB_CLASS_SIZE;
+	struct slab_run **partial = &arena->slab.partial[class];
+	struct slab_run *run = *partial;
+	int i, bit;
+
+	if (!run) {
+		run = get_run(arena, (class + 1) * SLAB_CLASS_SIZE);
+		if (!run)
+			return NULL;
+		run_list_add(partial, run);
+	}
+
+	for (i = 0; !run->free_map[i]; i++)
+		;
+
+	bit = __builtin_ctzl(run->free_map[i]);
+	run->free_map[i] &= run->free_map[i] - 1;
+
+	if (--run->nr_free == 0)
+		run_list_del(partial, run);
+
+	return run->objects + (i * 64 + bit) * run->size;
+}
+
+struct slab_run *slab_lookup(void *ptr)
+{
+	struct slab_run *run = pagemap_get(ptr);
+
+	return run && run->size ? run : NULL;
+}
+
+void slab_free(struct slab_run *run, void *ptr)
+{
+	size_t idx = ((char *)ptr - run->objects) / run->size;
+	unsigned int class = run->size / SLAB_CLASS_SIZE - 1;
+	struct slab_run **partial = &run->chunk->arena->slab.partial[class];
+	uint64_t mask = 1UL << (idx % 64);
+
+	// the object is already free
+	if (run->free_map[idx / 64] & mask)
+		return;
+
+	run->free_map[idx / 64] |= mask;
+	if (run->nr_free++ == 0)
+		run_list_add(partial, run);
+
+	// a run that empties is given back, unless the class has no other one
+	if (run->nr_free == RUN_SIZE / run->size &&
+	    (run->prev || run->next)) {
+		run_list_del(partial, run);
+		put_run(run);
+	}
+}
+
+size_t slab_size(struct slab_run *run)
+{
+	return run->size;
+}
+
+struct arena *slab_arena(struct slab_run *run)
+{
+	return run->chunk->arena;
+}
@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+#include <stddef.h>
+#include "block.h"
+
+// requests up to SLAB_MAX_SIZE bytes are served from slab runs, whose
+// classes are at least ALIGNMENT bytes apart so that every object is aligned
+#define SLAB_CLASS_SIZE (ALIGNMENT > 16 ? ALIGNMENT : 16)
+#define SLAB_MAX_SIZE 256
+
+#define NR_SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_CLASS_SIZE)
+
+struct slab_run;
+struct arena;
+
+// slab runs of one arena
+struct slab_cache {
+	// runs with free objects for every class
+	struct slab_run *partial[NR_SLAB_CLASSES];
+	// runs not used by any class and the number of chunks made only of them
+	struct slab_run *empty_runs;
+	unsigned int empty_chunks;
+};
+
+#ifdef SLAB
+
+// return an object of at least size bytes from the runs of the arena,
+// size must not exceed SLAB_MAX_SIZE
+void *slab_alloc(struct arena *arena, size_t size);
+
+// return the run holding ptr, or NULL if ptr is not a slab object
+struct slab_run *slab_lookup(void *ptr);
+
+// give an object back to its run, the arena of the run must be locked
+void slab_free(struct slab_run *run, void *ptr);
+
+// size of the objects of a run
+size_t slab_size(struct slab_run *run);
+
+// arena the run belongs to
+struct arena *slab_arena(struct slab_run *run);
+
+// size of the object slab_alloc() returns for size bytes
+static inline size_t slab_class_size(size_t size)
+{
+	return (size + SLAB_CLASS_SIZE - 1) & ~(SLAB_CLASS_SIZE - 1);
+}
+
+#else
+
+static inline void *slab_alloc(struct arena *arena, size_t size)
+{
+	(void)arena;
+	(void)size;
+	return NULL;
+}
+
+static inline struct slab_run *slab_lookup(void *ptr)
+{
+	(void)ptr;
+	return NULL;
+}
+
+static inline void slab_free(struct slab_run *run, void *ptr)
+{
+	(void)run;
+	(void)ptr;
+}
+
+static inline size_t slab_size(struct slab_run *run)
+{
+	(void)run;
+	return 0;
+}
+
+static inline size_t slab_class_size(size_t size)
+{
+	return size;
+}
+
+static inline struct arena *slab_arena(struct slab_run *run)
+{
+	(void)run;
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <errno.h>
+#include "printf.h"
+#include "block.h"
+#include "heap.h"
+#include "osmem_ext.h"
+#include "options.h"
+#include "stats.h"
+
+struct stats stats;
+
+void stat_footprint(long n)
+{
+	long footprint = __atomic_add_fetch(&stats.footprint, n, __ATOMIC_RELAXED);
+	long peak = __atomic_load_n(&stats.peak, __ATOMIC_RELAXED);
+
+	while (footprint > peak &&
+	       !__atomic_compare_exchange_n(&stats.peak, &peak, footprint, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+struct os_mallinfo os_mallinfo(void)
+{
+	struct arena_stats sum = { 0 };
+	struct os_mallinfo info;
+
+	arena_stats(&sum);
+
+	info = (struct os_mallinfo) {
+		.mmap_threshold = __atomic_load_n(&options.mmap_threshold, __ATOMIC_RELAXED),
+		.heap_bytes = sum.heap_bytes,
+		// every block of the heaps is either allocated or free
+		.allocated_bytes = sum.heap_bytes - sum.blocks * META_SIZE - sum.free_bytes,
+		.allocated_blocks = sum.blocks - sum.free_blocks,
+		.free_bytes = sum.free_bytes,
+		.free_blocks = sum.free_blocks,
+		.mapped_bytes = __atomic_load_n(&stats.mapped_bytes, __ATOMIC_RELAXED),
+		.mapped_blocks = __atomic_load_n(&stats.mapped_blocks, __ATOMIC_RELAXED),
+		.peak_bytes = __atomic_load_n(&stats.peak, __ATOMIC_RELAXED),
+		.sbrk_calls = __atomic_load_n(&stats.sbrk_calls, __ATOMIC_RELAXED),
+		.mmap_calls = __atomic_load_n(&stats.mmap_calls, __ATOMIC_RELAXED),
+		.munmap_calls = __atomic_load_n(&stats.munmap_calls, __ATOMIC_RELAXED),
+		.splits = sum.splits,
+		.coalesces = sum.coalesces,
+	};
+
+	return info;
+}
+
+void os_malloc_stats(void)
+{
+	struct os_mallinfo info = os_mallinfo();
+
+	printf("heap bytes       = %zu\n", info.heap_bytes);
+	printf("allocated bytes  = %zu in %zu blocks\n", info.allocated_bytes, info.allocated_blocks);
+	printf("free bytes       = %zu in %zu blocks\n", info.free_bytes, info.free_blocks);
+	printf("mapped bytes     = %zu in %zu blocks\n", info.mapped_bytes, info.mapped_blocks);
+	printf("peak bytes       = %zu\n", info.peak_bytes);
+	printf("mmap threshold   = %zu\n", info.mmap_threshold);
+	printf("sbrk calls       = %zu\n", info.sbrk_calls);
+	printf("mmap calls       = %zu\n", info.mmap_calls);
+	printf("munmap calls     = %zu\n", info.munmap_calls);
+	printf("splits           = %zu\n", info.splits);
+	printf("coalesces        = %zu\n", info.coalesces);
+}
+
+#ifndef HISTOGRAM
+// the histograms are only kept in a build with HISTOGRAM=1
+int os_histogram_dump(int fd)
+{
+	(void)fd;
+	errno = ENOSYS;
+	return -1;
+}
+#endif
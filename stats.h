@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+// counters that are not kept by the arenas, they change on the paths that
+// make syscalls and are updated with relaxed atomics
+struct stats {
+	long sbrk_calls;
+	long mmap_calls;
+	long munmap_calls;
+	// mapped blocks in use and their bytes
+	long mapped_blocks;
+	long mapped_bytes;
+	// bytes of the heaps, of the mapped blocks and of the chunks kept by
+	// the mmap cache, and the most they reached
+	long footprint;
+	long peak;
+};
+
+extern struct stats stats;
+
+static inline void stat_add(long *counter, long n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// the footprint changes by n bytes
+void stat_footprint(long n);
@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+#include "block.h"
+#include "heap.h"
+#include "slab.h"
+#include "cache.h"
+
+// objects up to TCACHE_MAX_SIZE bytes are cached, one bin per ALIGNMENT step
+#define TCACHE_MAX_SIZE 512
+#define TCACHE_BINS (TCACHE_MAX_SIZE / ALIGNMENT)
+
+// objects kept in a bin, refills and flushes move half of them at once
+#define TCACHE_COUNT 16
+#define TCACHE_BATCH (TCACHE_COUNT / 2)
+
+// cached objects stay allocated for the heap and are linked through their
+// first word
+struct tcache_entry {
+	struct tcache_entry *next;
+};
+
+struct tcache {
+	struct tcache_entry *bins[TCACHE_BINS];
+	unsigned char counts[TCACHE_BINS];
+	// 0 before the first use, 1 while in use, -1 once the thread exits
+	int state;
+};
+
+static __thread struct tcache tcache __attribute__((tls_model("initial-exec")));
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+// the thread exits, its cached objects go back to their arenas
+static void tcache_destroy(void *arg)
+{
+	int i;
+
+	(void)arg;
+	for (i = 0; i < TCACHE_BINS; i++) {
+		arena_free_list(tcache.bins[i]);
+		tcache.bins[i] = NULL;
+		tcache.counts[i] = 0;
+	}
+
+	// frees done later by other destructors go straight to the heap
+	tcache.state = -1;
+}
+
+static void tcache_key_create(void)
+{
+	pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+// the key destructor flushes the cache when the thread exits
+static int tcache_init(void)
+{
+	if (tcache.state)
+		return tcache.state > 0;
+
+	pthread_once(&tcache_once, tcache_key_create);
+	pthread_setspecific(tcache_key, &tcache);
+	tcache.state = 1;
+
+	return 1;
+}
+
+// map an object size to its bin, or return -1 if it is not cached
+static int tcache_bin(size_t size)
+{
+	if (size > TCACHE_MAX_SIZE || !tcache_init())
+		return -1;
+
+	return size / ALIGNMENT - 1;
+}
+
+void *cache_alloc(size_t size)
+{
+	struct tcache_entry *entry;
+	struct arena *arena;
+	int bin, i;
+
+	// slab_alloc() rounds small sizes up to their class
+	if (size <= SLAB_MAX_SIZE)
+		size = slab_class_size(size);
+
+	bin = tcache_bin(size);
+	if (bin < 0)
+		return NULL;
+
+	if (!tcache.bins[bin]) {
+		arena = arena_get();
+		for (i = 0; i < TCACHE_BATCH; i++) {
+			entry = heap_malloc(arena, size);
+			if (!entry)
+				break;
+			entry->next = tcache.bins[bin];
+			tcache.bins[bin] = entry;
+			tcache.counts[bin]++;
+		}
+		arena_unlock(arena);
+
+		if (!tcache.bins[bin])
+			return NULL;
+	}
+
+	entry = tcache.bins[bin];
+	tcache.bins[bin] = entry->next;
+	tcache.counts[bin]--;
+
+	return entry;
+}
+
+int cache_free(void *ptr, size_t size)
+{
+	struct tcache_entry *entry = ptr;
+	int bin = tcache_bin(size);
+	int i;
+
+	if (bin < 0)
+		return 0;
+
+	entry->next = tcache.bins[bin];
+	tcache.bins[bin] = entry;
+	if (++tcache.counts[bin] <= TCACHE_COUNT)
+		return 1;
+
+	// the bin is full, the oldest half goes back to the heap
+	for (i = 1; i < TCACHE_BATCH; i++)
+		entry = entry->next;
+
+	arena_free_list(entry->next);
+	entry->next = NULL;
+	tcache.counts[bin] = TCACHE_BATCH;
+
+	return 1;
+}
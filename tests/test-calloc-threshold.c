@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// os_calloc() maps every chunk bigger than a page and takes smaller ones
+// from the heap, whatever the mmap threshold of os_malloc() is
+
+#include <stdio.h>
+#include <unistd.h>
+#include "osmem.h"
+#include "osmem_ext.h"
+
+static int check(size_t size, size_t mapped)
+{
+	size_t before = os_mallinfo().mapped_blocks;
+	unsigned char *ptr = os_calloc(1, size);
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (ptr[i]) {
+			printf("%zu bytes: not zero at %zu\n", size, i);
+			return 1;
+		}
+	}
+
+	if (os_mallinfo().mapped_blocks - before != mapped) {
+		printf("%zu bytes: %s mapped\n", size, mapped ? "not" : "wrongly");
+		return 1;
+	}
+
+	os_free(ptr);
+	return 0;
+}
+
+int main(void)
+{
+	size_t page_size = getpagesize();
+
+	if (check(100, 0) || check(page_size / 2, 0) || check(page_size + 1, 1) ||
+	    check(4 * page_size, 1)) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
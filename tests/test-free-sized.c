@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// os_free_sized() accepts any size up to the usable one: a heap block, a
+// slab object and a mapped block freed with a smaller size go back where
+// they came from, and a smaller size never hands a mapping out again
+
+#include <stdio.h>
+#include "osmem.h"
+#include "osmem_ext.h"
+
+#define ROUNDS 1000
+#define SMALL_SIZE 100
+
+static int check(const char *name, size_t size, size_t hint)
+{
+	size_t mapped = os_mallinfo().mapped_blocks;
+	void *ptr, *small[4];
+	int round, i;
+
+	for (round = 0; round < ROUNDS; round++) {
+		ptr = os_malloc(size);
+		os_free_sized(ptr, hint);
+
+		for (i = 0; i < 4; i++) {
+			small[i] = os_malloc(SMALL_SIZE);
+			if (os_malloc_usable_size(small[i]) >= size && size > SMALL_SIZE) {
+				printf("%s: %zu bytes handed out again for %d\n", name, size, SMALL_SIZE);
+				return 1;
+			}
+		}
+		for (i = 0; i < 4; i++)
+			os_free(small[i]);
+	}
+
+	if (os_mallinfo().mapped_blocks != mapped) {
+		printf("%s: %zu mapped blocks left\n", name, os_mallinfo().mapped_blocks - mapped);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	if (check("heap", 1000, 1) || check("slab", 200, 1) ||
+	    check("mapped", 200000, SMALL_SIZE)) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
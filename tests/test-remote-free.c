@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// objects allocated by threads that exited and freed by another thread go
+// back to the heap, which stays the same size from one round to the next
+
+#include <pthread.h>
+#include <stdio.h>
+#include "osmem.h"
+#include "osmem_ext.h"
+
+#define ROUNDS 4
+#define OBJECTS 25000
+#define OBJECT_SIZE 4000
+
+static void *objects[OBJECTS];
+
+static void *worker(void *arg)
+{
+	int i;
+
+	(void)arg;
+	for (i = 0; i < OBJECTS; i++)
+		objects[i] = os_malloc(OBJECT_SIZE);
+
+	return NULL;
+}
+
+int main(void)
+{
+	struct os_mallinfo info;
+	size_t heap_bytes = 0;
+	pthread_t thread;
+	int round, i;
+
+	for (round = 0; round < ROUNDS; round++) {
+		pthread_create(&thread, NULL, worker, NULL);
+		pthread_join(thread, NULL);
+
+		for (i = 0; i < OBJECTS; i++)
+			os_free(objects[i]);
+
+		info = os_mallinfo();
+		if (!round)
+			heap_bytes = info.heap_bytes;
+
+		printf("round %d: heap %zu bytes, allocated %zu bytes\n",
+		       round, info.heap_bytes, info.allocated_bytes);
+		if (info.allocated_bytes > OBJECTS * OBJECT_SIZE / 100 ||
+		    info.heap_bytes > heap_bytes + heap_bytes / 2) {
+			printf("FAILED\n");
+			return 1;
+		}
+	}
+
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "freelist.h"
+
+// index of the most significant bit set
+static inline int fls_size(size_t size)
+{
+	return 63 - __builtin_clzl(size);
+}
+
+// map a size to the list holding free blocks of that size
+static void mapping_insert(size_t size, int *fl, int *sl)
+{
+	int bit;
+
+	if (size < SMALL_SIZE) {
+		*fl = 0;
+		*sl = size >> ALIGN_LOG2;
+		return;
+	}
+
+	bit = fls_size(size);
+	*sl = (size >> (bit - SL_LOG2)) ^ SL_COUNT;
+	*fl = bit - FL_SHIFT + 1;
+}
+
+// map a size to the first list whose blocks are all big enough for it
+static void mapping_search(size_t size, int *fl, int *sl)
+{
+	if (size >= SMALL_SIZE)
+		size += (1UL << (fls_size(size) - SL_LOG2)) - 1;
+
+	mapping_insert(size, fl, sl);
+}
+
+void freelist_insert(struct freelist *list, struct block *block)
+{
+	int fl, sl;
+
+	mapping_insert(block_size(block), &fl, &sl);
+	set_free_prev(block, NULL);
+	set_free_next(block, list->blocks[fl][sl]);
+	if (list->blocks[fl][sl])
+		set_free_prev(list->blocks[fl][sl], block);
+	list->blocks[fl][sl] = block;
+
+	list->fl_bitmap |= 1UL << fl;
+	list->sl_bitmap[fl] |= 1U << sl;
+}
+
+void freelist_remove(struct freelist *list, struct block *block)
+{
+	struct block *prev = free_prev(block);
+	struct block *next = free_next(block);
+	int fl, sl;
+
+	mapping_insert(block_size(block), &fl, &sl);
+	if (prev)
+		set_free_next(prev, next);
+	else
+		list->blocks[fl][sl] = next;
+
+	if (next)
+		set_free_prev(next, prev);
+
+	if (!list->blocks[fl][sl]) {
+		list->sl_bitmap[fl] &= ~(1U << sl);
+		if (!list->sl_bitmap[fl])
+			list->fl_bitmap &= ~(1UL << fl);
+	}
+}
+
+struct block *freelist_find(struct freelist *list, size_t size)
+{
+	struct block *head;
+	uint64_t fl_map;
+	uint32_t sl_map;
+	int fl, sl;
+
+	mapping_search(size, &fl, &sl);
+	if (fl < FL_COUNT) {
+		sl_map = list->sl_bitmap[fl] & (~0U << sl);
+		if (!sl_map) {
+			fl_map = fl + 1 < FL_COUNT ? list->fl_bitmap & (~0UL << (fl + 1)) : 0;
+			if (fl_map) {
+				fl = __builtin_ctzl(fl_map);
+				sl_map = list->sl_bitmap[fl];
+			}
+		}
+
+		if (sl_map)
+			return list->blocks[fl][__builtin_ctz(sl_map)];
+	}
+
+	// the class of size itself may still hold a block that fits
+	mapping_insert(size, &fl, &sl);
+	head = list->blocks[fl][sl];
+
+	return head && block_size(head) >= size ? head : NULL;
+}
@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+#include <stdint.h>
+#include "block.h"
+
+// two-level segregated fit: the first level splits sizes by powers of two,
+// the second level splits every power of two in SL_COUNT linear classes
+#define SL_LOG2 4
+#define SL_COUNT (1 << SL_LOG2)
+#define ALIGN_LOG2 (__builtin_ctzl(ALIGNMENT))
+
+// sizes below SMALL_SIZE all live in the first level 0, one class per ALIGNMENT
+#define FL_SHIFT (SL_LOG2 + ALIGN_LOG2)
+#define SMALL_SIZE (1UL << FL_SHIFT)
+#define FL_COUNT (64 - FL_SHIFT + 1)
+
+// two-level index of one arena
+struct freelist {
+	struct block *blocks[FL_COUNT][SL_COUNT];
+	uint64_t fl_bitmap;
+	uint32_t sl_bitmap[FL_COUNT];
+};